@@ -1,7 +1,439 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../src/lab.h"
 
-int main(void)
+/*
+ * Replays a recorded allocation trace against a buddy pool so pool sizing
+ * can be tried against a real workload offline.
+ *
+ * A trace file is a struct trace_header followed by header.count struct
+ * trace_rec in time order. Object ids are dense, 0 to header.max_id - 1, and
+ * an id may be reused once it has been freed. The file is memory mapped, so
+ * traces larger than RAM replay fine.
+ *
+ * With more than one thread, record r is replayed by thread
+ * r.thread % threads. Calls on the same object still happen in file order,
+ * a thread waits for the other threads to replay the earlier calls on an
+ * object first. That can not deadlock as long as the trace is in time order.
+ */
+
+#define TRACE_MAGIC "BTRACE01"
+
+#define OP_ALLOC   1  /*Allocate size bytes for id*/
+#define OP_FREE    2  /*Free id*/
+#define OP_REALLOC 3  /*Resize id to size bytes*/
+
+struct trace_header
+{
+  char magic[8];                /*TRACE_MAGIC*/
+  uint64_t count;               /*Number of records that follow*/
+  uint64_t max_id;              /*One past the largest object id used*/
+};
+
+struct trace_rec
+{
+  uint64_t ns;                  /*When the call happened, only used for ordering*/
+  uint64_t id;                  /*Object the call acts on*/
+  uint64_t size;                /*Bytes requested, 0 for a free*/
+  uint32_t thread;              /*Thread that made the call*/
+  uint8_t op;                   /*One of the OP_* codes*/
+  uint8_t pad[3];
+};
+
+/*Marks an object whose allocation was replayed but failed*/
+#define FAILED ((void *)1)
+
+struct replay
+{
+  struct buddy_pool pool;
+  const struct trace_rec *recs;
+  uint64_t count;
+  void **objs;                  /*Live pointer for each id, NULL before it is allocated*/
+  uint64_t *sizes;              /*Bytes requested for each live id*/
+  uint32_t *turn;               /*Calls replayed so far on each id (threads > 1 only)*/
+  uint32_t *seq;                /*Position of each record among the calls on its id*/
+  unsigned int threads;
+  uint64_t interval;            /*Records thread 0 replays between samples*/
+  bool exact_peaks;             /*Check the peaks after every allocation, not only at samples*/
+  size_t peak_allocated;        /*Highest allocated bytes seen*/
+  int64_t peak_requested;       /*Highest live requested bytes seen*/
+};
+
+struct worker
+{
+  struct replay *r;
+  unsigned int id;
+  uint64_t ops;
+  uint64_t failures;
+  int64_t live;                 /*Bytes requested by the objects this thread allocated minus freed*/
+  size_t peak_allocated;        /*Highest allocated bytes after this thread's allocations (-p)*/
+  int64_t peak_requested;       /*Highest live requested bytes after them (-p)*/
+  char pad[64];
+};
+
+static struct worker *workers;
+
+/**
+ * Sum of live requested bytes over every worker
+ */
+static int64_t live_requested(struct replay *r)
+{
+  int64_t live = 0;
+  for (unsigned int t = 0; t < r->threads; t++) {
+    live += __atomic_load_n(&workers[t].live, __ATOMIC_RELAXED);
+  }
+  return live;
+}
+
+/**
+ * Raise a worker's peaks to the pool's current footprint. With -p this runs
+ * after every allocation and realloc, so spikes between two samples are
+ * caught. The peaks are the worker's own and merged after the run, but the
+ * pool and every worker's live count are still read, so it costs
+ * throughput.
+ */
+static void update_peaks(struct worker *w)
+{
+  struct buddy_stats st;
+  buddy_stats(&w->r->pool, &st);
+  int64_t requested = live_requested(w->r);
+  if (st.allocated > w->peak_allocated) {
+    w->peak_allocated = st.allocated;
+  }
+  if (requested > w->peak_requested) {
+    w->peak_requested = requested;
+  }
+}
+
+/**
+ * Print one row of the fragmentation time series and raise the sampled peaks
+ */
+static void sample(struct replay *r, uint64_t done)
+{
+  struct buddy_stats st;
+  buddy_stats(&r->pool, &st);
+  int64_t requested = live_requested(r);
+  if (st.allocated > r->peak_allocated) {
+    r->peak_allocated = st.allocated;
+  }
+  if (requested > r->peak_requested) {
+    r->peak_requested = requested;
+  }
+
+  // Internal: reserved bytes nobody asked for. External: free memory that
+  // is not part of the largest free block and so can not serve a big request
+  double internal = st.allocated ? 100.0 * (double)((int64_t)st.allocated - requested) / (double)st.allocated : 0;
+  double external = st.free ? 100.0 * (double)(st.free - st.largest_free) / (double)st.free : 0;
+  printf("%12llu %14zu %14lld %14zu %9.1f%% %9.1f%% %10llu\n", (unsigned long long)done,
+         st.allocated, (long long)requested, st.largest_free, internal, external,
+         (unsigned long long)st.failures);
+}
+
+static void replay_one(struct worker *w, const struct trace_rec *rec)
+{
+  struct replay *r = w->r;
+  void *p;
+
+  switch (rec->op) {
+  case OP_ALLOC:
+    p = buddy_malloc(&r->pool, rec->size);
+    if (!p) {
+      w->failures++;
+      p = FAILED;
+    } else {
+      r->sizes[rec->id] = rec->size;
+      __atomic_store_n(&w->live, w->live + (int64_t)rec->size, __ATOMIC_RELAXED);
+      if (r->exact_peaks) {
+        update_peaks(w);
+      }
+    }
+    r->objs[rec->id] = p;
+    break;
+  case OP_FREE:
+    p = r->objs[rec->id];
+    if (p && p != FAILED) {
+      buddy_free(&r->pool, p);
+      __atomic_store_n(&w->live, w->live - (int64_t)r->sizes[rec->id], __ATOMIC_RELAXED);
+    }
+    r->objs[rec->id] = NULL;
+    break;
+  case OP_REALLOC:
+    p = r->objs[rec->id];
+    if (!p || p == FAILED) {
+      break;
+    }
+    void *moved = buddy_realloc(&r->pool, p, rec->size);
+    if (!moved) {
+      w->failures++;
+      break;
+    }
+    __atomic_store_n(&w->live, w->live + (int64_t)rec->size - (int64_t)r->sizes[rec->id],
+                     __ATOMIC_RELAXED);
+    r->sizes[rec->id] = rec->size;
+    r->objs[rec->id] = moved;
+    if (r->exact_peaks) {
+      update_peaks(w);
+    }
+    break;
+  }
+}
+
+static void *worker_main(void *arg)
 {
-  printf("hello world\n");
+  struct worker *w = arg;
+  struct replay *r = w->r;
+  uint64_t done = 0;
+
+  for (uint64_t i = 0; i < r->count; i++) {
+    const struct trace_rec *rec = &r->recs[i];
+    if (rec->thread % r->threads != w->id) {
+      continue;
+    }
+    if (r->threads > 1) {
+      // Earlier calls on this object may belong to other threads
+      while (__atomic_load_n(&r->turn[rec->id], __ATOMIC_ACQUIRE) != r->seq[i]) {
+        sched_yield();
+      }
+      replay_one(w, rec);
+      __atomic_store_n(&r->turn[rec->id], r->seq[i] + 1, __ATOMIC_RELEASE);
+    } else {
+      replay_one(w, rec);
+    }
+    w->ops++;
+    // Thread 0 doubles as the sampler, its progress is a good enough clock
+    if (w->id == 0 && ++done % r->interval == 0) {
+      sample(r, i + 1);
+    }
+  }
+  // Magazines hold on to blocks until the thread that filled them lets go
+  buddy_magazine_flush(&r->pool);
+  return NULL;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write a synthetic trace of n records from four threads, handy for trying
+ * the tool out and for checking the file format. A trace that can not be
+ * written in full is removed rather than left with a header that lies.
+ */
+static int generate(const char *path, uint64_t n)
+{
+  static const uint64_t sizes[] = { 16, 24, 32, 48, 64, 100, 128, 256, 500, 1024, 4000, 65536 };
+  uint64_t max_id = 4096;
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+
+  struct trace_header hdr = { .count = n, .max_id = max_id };
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  bool *live = calloc(max_id, sizeof(bool));
+  uint32_t *owner = calloc(max_id, sizeof(uint32_t));
+  bool ok = live && owner && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  uint64_t seed = 1;
+  for (uint64_t i = 0; ok && i < n; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    uint64_t id = seed % max_id;
+    struct trace_rec rec = { .ns = i * 100, .id = id, .thread = (uint32_t)(seed >> 32) % 4 };
+    if (!live[id]) {
+      rec.op = OP_ALLOC;
+      rec.size = sizes[(seed >> 16) % (sizeof(sizes) / sizeof(sizes[0]))];
+      owner[id] = rec.thread;
+      live[id] = true;
+    } else if ((seed >> 20) % 8 == 0) {
+      rec.op = OP_REALLOC;
+      rec.size = sizes[(seed >> 16) % (sizeof(sizes) / sizeof(sizes[0]))];
+      rec.thread = owner[id];
+    } else {
+      rec.op = OP_FREE;
+      live[id] = false;
+    }
+    ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+  }
+  free(live);
+  free(owner);
+  if (!ok) {
+    perror(path);
+  }
+  if (fclose(f) != 0 && ok) {
+    perror(path);
+    ok = false;
+  }
+  if (!ok) {
+    unlink(path);
+    return 1;
+  }
+  return 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-s pool_bytes] [-t threads] [-m magazine_depth] [-i interval] [-p] trace\n"
+          "       %s -g records trace\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+  size_t pool_bytes = 0;
+  unsigned int threads = 1;
+  unsigned int mag_depth = 0;
+  uint64_t interval = 100000;
+  uint64_t gen = 0;
+  bool exact_peaks = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:t:m:i:g:p")) != -1) {
+    switch (opt) {
+    case 's': pool_bytes = strtoull(optarg, NULL, 0); break;
+    case 't': threads = (unsigned int)strtoul(optarg, NULL, 0); break;
+    case 'm': mag_depth = (unsigned int)strtoul(optarg, NULL, 0); break;
+    case 'i': interval = strtoull(optarg, NULL, 0); break;
+    case 'g': gen = strtoull(optarg, NULL, 0); break;
+    case 'p': exact_peaks = true; break;
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if (optind != argc - 1 || threads == 0 || interval == 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  const char *path = argv[optind];
+  if (gen) {
+    return generate(path, gen);
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    perror(path);
+    return 1;
+  }
+  void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  const struct trace_header *hdr = map;
+  if ((size_t)sb.st_size < sizeof(*hdr) || memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->count > ((size_t)sb.st_size - sizeof(*hdr)) / sizeof(struct trace_rec)) {
+    fprintf(stderr, "%s: not a trace file or truncated\n", path);
+    return 1;
+  }
+  madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+
+  struct replay r = {
+    .recs = (const struct trace_rec *)(hdr + 1),
+    .count = hdr->count,
+    .objs = calloc(hdr->max_id, sizeof(void *)),
+    .sizes = calloc(hdr->max_id, sizeof(uint64_t)),
+    .threads = threads,
+    .interval = interval,
+    .exact_peaks = exact_peaks,
+  };
+  if (threads > 1) {
+    r.turn = calloc(hdr->max_id, sizeof(uint32_t));
+    r.seq = malloc(sizeof(uint32_t) * (r.count ? r.count : 1));
+    if (!r.turn || !r.seq) {
+      perror("calloc");
+      return 1;
+    }
+  }
+  for (uint64_t i = 0; i < r.count; i++) {
+    if (r.recs[i].id >= hdr->max_id) {
+      fprintf(stderr, "%s: record %llu has id past max_id\n", path, (unsigned long long)i);
+      return 1;
+    }
+    //Number the calls on each object, turn is reset again below
+    if (r.seq) {
+      r.seq[i] = r.turn[r.recs[i].id]++;
+    }
+  }
+  if (r.turn) {
+    memset(r.turn, 0, sizeof(uint32_t) * hdr->max_id);
+  }
+
+  struct buddy_options opts = {
+    .flags = threads > 1 ? BUDDY_CONCURRENT : 0,
+    .magazine_depth = mag_depth,
+  };
+  if (!r.objs || !r.sizes || buddy_init_opts(&r.pool, pool_bytes, &opts) != 0) {
+    perror("buddy_init_opts");
+    return 1;
+  }
+
+  workers = calloc(threads, sizeof(struct worker));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  if (!workers || !tids) {
+    perror("calloc");
+    return 1;
+  }
+  printf("%12s %14s %14s %14s %10s %10s %10s\n", "records", "allocated", "requested",
+         "largest free", "internal", "external", "failures");
+
+  double start = now_sec();
+  // Every worker reads the others' live counts, so set them all up first
+  for (unsigned int t = 0; t < threads; t++) {
+    workers[t] = (struct worker){ .r = &r, .id = t };
+  }
+  for (unsigned int t = 0; t < threads; t++) {
+    // Started workers may be waiting on records only this one replays, so
+    // there is nothing to join, leave and let exit take them down
+    int rc = pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    if (rc != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      exit(1);
+    }
+  }
+  uint64_t ops = 0, failures = 0;
+  for (unsigned int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+    ops += workers[t].ops;
+    failures += workers[t].failures;
+    if (workers[t].peak_allocated > r.peak_allocated) {
+      r.peak_allocated = workers[t].peak_allocated;
+    }
+    if (workers[t].peak_requested > r.peak_requested) {
+      r.peak_requested = workers[t].peak_requested;
+    }
+  }
+  double elapsed = now_sec() - start;
+  sample(&r, r.count);
+
+  printf("\npool %zu bytes, %u thread(s), %llu records in %.3fs, %.2f Mops/s%s\n",
+         r.pool.numbytes, threads, (unsigned long long)ops, elapsed,
+         (double)ops / elapsed / 1e6, exact_peaks ? " (including peak tracking)" : "");
+  printf("failures %llu, %s peak allocated %zu bytes, peak requested %lld bytes\n",
+         (unsigned long long)failures, exact_peaks ? "exact" : "sampled", r.peak_allocated,
+         (long long)r.peak_requested);
+
+  buddy_destroy(&r.pool);
+  munmap(map, (size_t)sb.st_size);
+  free(r.objs);
+  free(r.sizes);
+  free(r.turn);
+  free(r.seq);
+  free(workers);
+  free(tids);
   return 0;
 }
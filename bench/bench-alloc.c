@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "../src/lab.h"
+
+/*
+ * Single threaded microbenchmarks for buddy_malloc/buddy_free with system
+ * malloc as the baseline. Every workload draws from its own fixed seed so two
+ * runs, or two builds, see exactly the same sequence of requests. Each
+ * workload runs in a forked child so the peak RSS reported belongs to that
+ * workload alone. Where perf events are allowed the data TLB misses of each
+ * run are counted too, which is what the huge page pools are for.
+ *
+ * Usage: bench-alloc [workload]
+ */
+
+#define OPS          1000000
+#define WORKING_SET  4096
+#define BATCH        4096
+#define POOL_SIZE    (UINT64_C(1) << 30)
+#define RANDOM_OBJS  (1 << 20)
+
+/*Latencies below 1us get a bucket per ns, above that 64 buckets per power of two*/
+#define HIST_LINEAR  1024
+#define HIST_SUB     64
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 10) * HIST_SUB)
+
+struct allocator
+{
+  const char *name;
+  unsigned int flags;           /*buddy_options flags for the pool, ignored by system*/
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+};
+
+static struct buddy_pool pool;
+
+static void *buddy_malloc_(size_t size) { return buddy_malloc(&pool, size); }
+static void buddy_free_(void *ptr) { buddy_free(&pool, ptr); }
+static void *buddy_realloc_(void *ptr, size_t size) { return buddy_realloc(&pool, ptr, size); }
+
+static const struct allocator allocators[] = {
+  { "buddy", 0, buddy_malloc_, buddy_free_, buddy_realloc_ },
+  { "buddy-thp", BUDDY_HUGE_THP, buddy_malloc_, buddy_free_, buddy_realloc_ },
+  { "buddy-slab", BUDDY_SLAB, buddy_malloc_, buddy_free_, buddy_realloc_ },
+  { "buddy-compact", BUDDY_COMPACT, buddy_malloc_, buddy_free_, buddy_realloc_ },
+  { "system", 0, malloc, free, realloc },
+};
+
+struct result
+{
+  uint64_t ops;
+  uint64_t total_ns;
+  uint64_t p50, p99, p999;
+  long peak_rss_kb;
+  int64_t tlb_misses;           /*-1 when perf events are not available*/
+};
+
+static uint64_t hist[HIST_BUCKETS];
+static uint64_t hist_ops;
+static uint64_t hist_total;
+static uint64_t timer_cost;
+static volatile uint64_t sink;  /*Keeps reads the compiler could drop alive*/
+
+/**
+ * xorshift64, the same numbers on every libc unlike rand()
+ */
+static uint64_t next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t hist_bucket(uint64_t ns)
+{
+  if (ns < HIST_LINEAR) {
+    return (size_t)ns;
+  }
+  size_t hb = (size_t)(63 - __builtin_clzll(ns));
+  return HIST_LINEAR + (hb - 10) * HIST_SUB + (size_t)((ns >> (hb - 6)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(size_t b)
+{
+  if (b < HIST_LINEAR) {
+    return b;
+  }
+  size_t hb = (b - HIST_LINEAR) / HIST_SUB + 10;
+  return (UINT64_C(1) << hb) + (uint64_t)((b - HIST_LINEAR) % HIST_SUB) * (UINT64_C(1) << (hb - 6));
+}
+
+/**
+ * Cheapest back to back clock read, taken off every sample
+ */
+static uint64_t calibrate(void)
+{
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 10000; i++) {
+    uint64_t t0 = now_ns();
+    uint64_t t1 = now_ns();
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+    }
+  }
+  return best;
+}
+
+static void record(uint64_t start)
+{
+  uint64_t ns = now_ns() - start;
+  ns = ns > timer_cost ? ns - timer_cost : 0;
+  hist[hist_bucket(ns)]++;
+  hist_ops++;
+  hist_total += ns;
+}
+
+static uint64_t percentile(double p)
+{
+  uint64_t want = (uint64_t)(p * (double)hist_ops);
+  uint64_t seen = 0;
+  for (size_t b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want) {
+      return hist_value(b);
+    }
+  }
+  return 0;
+}
+
+/*Touch the memory so both allocators pay for the pages they hand out*/
+#define TOUCH(p) (*(volatile char *)(p) = 1)
+
+#define TIMED(stmt)             \
+  do {                          \
+    uint64_t t0_ = now_ns();    \
+    stmt;                       \
+    record(t0_);                \
+  } while (0)
+
+/**
+ * Random alloc/free over a fixed working set of one size
+ */
+static void run_fixed(const struct allocator *a)
+{
+  static void *slots[WORKING_SET];
+  uint64_t seed = 1;
+  for (int op = 0; op < OPS; op++) {
+    size_t i = next_rand(&seed) % WORKING_SET;
+    if (slots[i]) {
+      TIMED(a->free(slots[i]));
+      slots[i] = NULL;
+    } else {
+      TIMED(slots[i] = a->malloc(64));
+      TOUCH(slots[i]);
+    }
+  }
+  for (size_t i = 0; i < WORKING_SET; i++) {
+    a->free(slots[i]);
+    slots[i] = NULL;
+  }
+}
+
+/**
+ * Same churn with the request sizes of test_malloc_mixed_sizes
+ */
+static void run_mixed(const struct allocator *a)
+{
+  static const size_t sizes[] = { 8, 24, 32, 64, 100, 128, 200, 400, 512, 800 };
+  static void *slots[WORKING_SET];
+  uint64_t seed = 2;
+  for (int op = 0; op < OPS; op++) {
+    size_t i = next_rand(&seed) % WORKING_SET;
+    if (slots[i]) {
+      TIMED(a->free(slots[i]));
+      slots[i] = NULL;
+    } else {
+      size_t size = sizes[next_rand(&seed) % (sizeof(sizes) / sizeof(sizes[0]))];
+      TIMED(slots[i] = a->malloc(size));
+      TOUCH(slots[i]);
+    }
+  }
+  for (size_t i = 0; i < WORKING_SET; i++) {
+    a->free(slots[i]);
+    slots[i] = NULL;
+  }
+}
+
+/**
+ * Allocate a batch then free it newest first (lifo) or oldest first (fifo)
+ */
+static void run_batches(const struct allocator *a, bool lifo, uint64_t seed)
+{
+  static void *batch[BATCH];
+  for (int done = 0; done < OPS; done += 2 * BATCH) {
+    for (size_t i = 0; i < BATCH; i++) {
+      size_t size = (size_t)(next_rand(&seed) % 1024) + 1;
+      TIMED(batch[i] = a->malloc(size));
+      TOUCH(batch[i]);
+    }
+    for (size_t i = 0; i < BATCH; i++) {
+      TIMED(a->free(batch[lifo ? BATCH - 1 - i : i]));
+    }
+  }
+}
+
+static void run_lifo(const struct allocator *a) { run_batches(a, true, 3); }
+static void run_fifo(const struct allocator *a) { run_batches(a, false, 4); }
+
+/**
+ * Grow buffers a little at a time up to 1MiB, the way a string builder or
+ * vector would, with a second buffer in between so growth is not always free
+ */
+static void run_realloc(const struct allocator *a)
+{
+  uint64_t seed = 5;
+  for (int done = 0; done < OPS;) {
+    char *buf = NULL;
+    char *other = NULL;
+    for (size_t size = 64; size <= (1 << 20); size += size / 4) {
+      TIMED(buf = a->realloc(buf, size));
+      buf[size - 1] = 1;
+      if (next_rand(&seed) % 4 == 0) {
+        TIMED(other = a->realloc(other, size / 2));
+        TOUCH(other);
+        done++;
+      }
+      done++;
+    }
+    TIMED(a->free(buf));
+    TIMED(a->free(other));
+    done += 2;
+  }
+}
+
+/**
+ * Scatter a million small objects over the pool then read and write them in
+ * random order. Every access is likely a TLB miss with 4KiB pages.
+ */
+static void run_random(const struct allocator *a)
+{
+  void **objs = malloc(sizeof(void *) * RANDOM_OBJS);
+  uint64_t seed = 6;
+  for (size_t i = 0; i < RANDOM_OBJS; i++) {
+    objs[i] = a->malloc(100);
+    memset(objs[i], (int)i, 100);
+  }
+  uint64_t sum = 0;
+  for (int op = 0; op < OPS; op++) {
+    char *p = objs[next_rand(&seed) % RANDOM_OBJS];
+    TIMED(sum += (uint64_t)p[op % 100]++);
+  }
+  for (size_t i = 0; i < RANDOM_OBJS; i++) {
+    a->free(objs[i]);
+  }
+  free(objs);
+  sink = sum;
+}
+
+/**
+ * Start counting user space data TLB read misses for this process
+ *
+ * @return the counter fd, -1 if perf events are not available
+ */
+static int tlb_open(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HW_CACHE;
+  pe.size = sizeof(pe);
+  pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static int64_t tlb_read(int fd)
+{
+  uint64_t count;
+  if (fd < 0 || read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+    return -1;
+  }
+  close(fd);
+  return (int64_t)count;
+}
+
+struct workload
+{
+  const char *name;
+  void (*run)(const struct allocator *a);
+};
+
+static const struct workload workloads[] = {
+  { "fixed", run_fixed },
+  { "mixed", run_mixed },
+  { "lifo", run_lifo },
+  { "fifo", run_fifo },
+  { "realloc", run_realloc },
+  { "random", run_random },
+};
+
+/**
+ * Run one workload against one allocator in a child process
+ */
+static int run_child(const struct workload *w, const struct allocator *a, struct result *out)
+{
+  int fd[2];
+  if (pipe(fd) != 0) {
+    perror("pipe");
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    close(fd[0]);
+    struct buddy_options opts = { .flags = a->flags };
+    if (buddy_init_opts(&pool, POOL_SIZE, &opts) != 0) {
+      _exit(1);
+    }
+    int tlb = tlb_open();
+    w->run(a);
+    int64_t misses = tlb_read(tlb);
+    buddy_destroy(&pool);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    struct result r = {
+      .ops = hist_ops,
+      .total_ns = hist_total,
+      .p50 = percentile(0.5),
+      .p99 = percentile(0.99),
+      .p999 = percentile(0.999),
+      .peak_rss_kb = ru.ru_maxrss,
+      .tlb_misses = misses,
+    };
+    ssize_t n = write(fd[1], &r, sizeof(r));
+    _exit(n == (ssize_t)sizeof(r) ? 0 : 1);
+  }
+
+  close(fd[1]);
+  ssize_t n = read(fd[0], out, sizeof(*out));
+  close(fd[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (n != (ssize_t)sizeof(*out) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s/%s: child failed\n", w->name, a->name);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = argc > 1 ? argv[1] : NULL;
+  int rval = 0;
+  timer_cost = calibrate();
+
+  printf("%-8s %-13s %10s %8s %8s %8s %8s %12s %12s\n", "workload", "alloc", "ops", "ns/op",
+         "p50", "p99", "p999", "peak RSS KiB", "dTLB misses");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    if (only && strcmp(only, workloads[w].name) != 0) {
+      continue;
+    }
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+      struct result r;
+      if (run_child(&workloads[w], &allocators[a], &r) != 0) {
+        rval = 1;
+        continue;
+      }
+      char tlb[24] = "-";
+      if (r.tlb_misses >= 0) {
+        snprintf(tlb, sizeof(tlb), "%lld", (long long)r.tlb_misses);
+      }
+      printf("%-8s %-13s %10llu %8.1f %8llu %8llu %8llu %12ld %12s\n", workloads[w].name,
+             allocators[a].name, (unsigned long long)r.ops, (double)r.total_ns / (double)r.ops,
+             (unsigned long long)r.p50, (unsigned long long)r.p99,
+             (unsigned long long)r.p999, r.peak_rss_kb, tlb);
+    }
+  }
+  return rval;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../src/lab.h"
+
+/*
+ * Throughput of one shared pool as the number of threads grows. Each thread
+ * churns through a small working set of random sized blocks. The same
+ * workload is run against a plain pool wrapped in one global mutex, which is
+ * what callers had to do before, a BUDDY_CONCURRENT pool, and a concurrent
+ * pool with per thread magazines.
+ */
+
+#define OPS_PER_THREAD 200000
+#define WORKING_SET    32
+#define MAX_THREADS    32
+
+struct bench_arg
+{
+  struct buddy_pool *pool;
+  pthread_mutex_t *global;
+  unsigned seed;
+};
+
+static void *worker(void *p)
+{
+  struct bench_arg *arg = p;
+  void *slots[WORKING_SET] = {0};
+
+  for (int op = 0; op < OPS_PER_THREAD; op++) {
+    int i = rand_r(&arg->seed) % WORKING_SET;
+    size_t size = (size_t)(rand_r(&arg->seed) % 1024) + 1;
+
+    if (arg->global) {
+      pthread_mutex_lock(arg->global);
+    }
+    if (slots[i]) {
+      buddy_free(arg->pool, slots[i]);
+      slots[i] = NULL;
+    } else {
+      slots[i] = buddy_malloc(arg->pool, size);
+    }
+    if (arg->global) {
+      pthread_mutex_unlock(arg->global);
+    }
+  }
+
+  for (int i = 0; i < WORKING_SET; i++) {
+    if (arg->global) {
+      pthread_mutex_lock(arg->global);
+    }
+    buddy_free(arg->pool, slots[i]);
+    if (arg->global) {
+      pthread_mutex_unlock(arg->global);
+    }
+  }
+  return NULL;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run the workload with nthreads threads and return million ops per second
+ */
+static double run(int nthreads, bool concurrent, unsigned int magazine_depth)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = {
+    .flags = concurrent ? BUDDY_CONCURRENT : 0,
+    .magazine_depth = magazine_depth,
+  };
+  pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+  pthread_t threads[MAX_THREADS];
+  struct bench_arg args[MAX_THREADS];
+
+  if (buddy_init_opts(&pool, UINT64_C(1) << 26, &opts) != 0) {
+    perror("buddy_init_opts");
+    exit(1);
+  }
+
+  double start = now_sec();
+  for (int t = 0; t < nthreads; t++) {
+    args[t] = (struct bench_arg){ &pool, concurrent ? NULL : &global, (unsigned)t + 1 };
+    pthread_create(&threads[t], NULL, worker, &args[t]);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  double elapsed = now_sec() - start;
+
+  buddy_destroy(&pool);
+  return (double)nthreads * OPS_PER_THREAD / elapsed / 1e6;
+}
+
+int main(void)
+{
+  printf("%8s %18s %18s %18s\n", "threads", "global mutex Mops", "concurrent Mops",
+         "magazines Mops");
+  for (int n = 1; n <= MAX_THREADS; n *= 2) {
+    double locked = run(n, false, 0);
+    double fine = run(n, true, 0);
+    double cached = run(n, true, 32);
+    printf("%8d %18.2f %18.2f %18.2f\n", n, locked, fine, cached);
+  }
+  return 0;
+}
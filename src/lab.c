@@ -8,6 +8,9 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -16,6 +19,14 @@
 
 #include "lab.h"
 
+/*Every flag buddy_init_opts knows how to honour*/
+#define BUDDY_KNOWN_FLAGS (BUDDY_CONCURRENT | BUDDY_OOB_META | BUDDY_BITTREE | BUDDY_CHECKED | \
+                           BUDDY_LAZY | BUDDY_MADV_FREE | BUDDY_HUGE_THP | BUDDY_HUGETLB | \
+                           BUDDY_GROW | BUDDY_SLAB | BUDDY_COMPACT)
+
+/*Flags buddy_init_shared accepts, the rest keep state outside the region*/
+#define BUDDY_SHARED_FLAGS (BUDDY_CONCURRENT | BUDDY_CHECKED | BUDDY_COMPACT)
+
 #define handle_error_and_die(msg) \
     do                            \
     {                             \
@@ -23,217 +34,3479 @@
         raise(SIGKILL);          \
     } while (0)
 
+#ifdef BUDDY_TRACE
+_Static_assert((BUDDY_TRACE_SLOTS & (BUDDY_TRACE_SLOTS - 1)) == 0,
+               "BUDDY_TRACE_SLOTS must be a power of two");
+
+static struct buddy_trace_rec trace_ring[BUDDY_TRACE_SLOTS];
+static uint64_t trace_next;
+
+/**
+ * @brief Append one record to the trace ring. Writers claim a sequence number
+ * with an atomic increment and publish the slot by storing seq last, so no
+ * lock is needed and a reader can tell when a slot changed under it.
+ */
+static void trace_record(struct buddy_pool *pool, uint8_t op, void *block,
+                         size_t size, size_t req_k, size_t kval)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t seq = __atomic_add_fetch(&trace_next, 1, __ATOMIC_RELAXED);
+    struct buddy_trace_rec *rec = &trace_ring[seq & (BUDDY_TRACE_SLOTS - 1)];
+
+    //Mark the slot as in flight before touching the payload
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    rec->pool = (uint64_t)(uintptr_t)pool;
+    rec->offset = block ? (uint64_t)((char *)block - (char *)pool->base) : 0;
+    rec->size = size;
+    rec->op = op;
+    rec->req_k = (uint8_t)req_k;
+    rec->kval = (uint8_t)kval;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+#define TRACE(pool, op, block, size, req_k, kval) \
+    trace_record(pool, op, block, size, req_k, kval)
+#else
+#define TRACE(pool, op, block, size, req_k, kval) \
+    do { (void)(size); (void)(req_k); (void)(kval); } while (0)
+#endif
+
+/**
+ * Per thread cache of reserved blocks for the small orders. slots holds
+ * BUDDY_MAG_ORDERS stacks of pool->mag_depth entries each.
+ */
+struct magazine
+{
+    struct buddy_pool *pool;                /*Pool the cached blocks belong to*/
+    unsigned int count[BUDDY_MAG_ORDERS];   /*Blocks cached for each order*/
+    struct avail *slots[];                  /*The cached block headers*/
+};
+
+/**
+ * Bookkeeping for BUDDY_BITTREE pools, kept at the start of its own mapping
+ * followed by the bitmaps. Bit i of an order k map describes the block at
+ * offset i << k from pool->base.
+ */
+struct bittree
+{
+    size_t bytes;               /*Length of the mapping holding this struct and the maps*/
+    uint64_t *free[MAX_K];      /*Block is free and whole, the bittree form of avail[k]*/
+    uint64_t *split[MAX_K];     /*Block has been split into two buddies*/
+    size_t hint[MAX_K];         /*No word of free[k] below this index has a bit set*/
+};
+
+/*Words of free bitmap a slab needs for its smallest class*/
+#define SLAB_WORDS ((((size_t)1 << BUDDY_SLAB_K) / 8 + 63) / 64)
+
+/**
+ * Header at the start of a BUDDY_SLAB slab, right after the block header if
+ * the pool has one. The slots follow it.
+ */
+struct slab
+{
+    struct slab *next;          /*Next slab of this class with a free slot*/
+    struct slab *prev;          /*Previous slab of this class with a free slot*/
+    unsigned int cls;           /*Size class, index into slab_sizes*/
+    unsigned int nslots;        /*Slots in this slab*/
+    unsigned int nfree;         /*Slots not handed out*/
+    char *slots;                /*First slot*/
+    uint64_t free[SLAB_WORDS];  /*Bit set for every free slot*/
+};
+
+/*Slot size of each slab class*/
+static const size_t slab_sizes[BUDDY_SLAB_CLASSES] = { 8, 16, 32, BUDDY_SLAB_MAX };
+
+/**
+ * @brief Index of the lowest set bit in a non-zero mask
+ *
+ * @param mask the mask to scan, must not be 0
+ * @return size_t the index of the lowest set bit
+ */
+static inline size_t lowest_bit(uint64_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)__builtin_ctzll(mask);
+#else
+    size_t k = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        k++;
+    }
+    return k;
+#endif
+}
+
+/**
+ * @brief Index of the highest set bit in a non-zero mask
+ *
+ * @param mask the mask to scan, must not be 0
+ * @return size_t the index of the highest set bit
+ */
+static inline size_t highest_bit(uint64_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)(63 - __builtin_clzll(mask));
+#else
+    size_t k = 0;
+    for (size_t step = 32; step > 0; step >>= 1) {
+        if (mask >> step) {
+            mask >>= step;
+            k += step;
+        }
+    }
+    return k;
+#endif
+}
+
 /**
  * @brief Convert bytes to the correct K value
  *
  * @param bytes the number of bytes
  * @return size_t the K value that will fit bytes
  */
- size_t btok(size_t bytes)
- {
-     size_t total = bytes;
-     size_t k = SMALLEST_K;
- 
-     while ((UINT64_C(1) << k) < total) {
-         k++;
-     }
+size_t btok(size_t bytes)
+{
+    // bytes <= 2^k  <=>  bytes - 1 < 2^k, so k is one past the highest set bit
+    // of bytes - 1. OR-ing in the low SMALLEST_K bits clamps small requests
+    // (and 0) to SMALLEST_K without a branch.
+    uint64_t below = (uint64_t)bytes - (bytes != 0);
+    return highest_bit(below | ((UINT64_C(1) << SMALLEST_K) - 1)) + 1;
+}
 
-     return k;
- }
+/*Side table entries hold the tag in the top two bits and the kval below it*/
+#define META(tag, kval) ((unsigned char)(((tag) << 6) | (kval)))
+#define META_KVAL 0x3f
 
- /**
-   * Find the buddy of a given pointer and kval relative to the base address we got from mmap
-   * @param pool The memory pool to work on (needed for the base addresses)
-   * @param buddy The memory block that we want to find the buddy for
-   * @return A pointer to the buddy
-   */
-struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
+/**
+ * @brief Pack a tag and kval into the layout of struct avail's state word
+ *
+ * @param tag the block tag
+ * @param kval the block order
+ * @return uint32_t the state word
+ */
+static inline uint32_t avail_state(unsigned short int tag, size_t kval)
 {
-    // Convert pointers to raw numbers
-    uintptr_t base_addr = (uintptr_t)(pool->base);
-    uintptr_t block_addr = (uintptr_t)(buddy);
+    struct avail a = { .tag = tag, .kval = (unsigned short int)kval };
+    return a.state;
+}
 
-    // Get how far this block is from the base of memory
-    uintptr_t offset = block_addr - base_addr;
+/**
+ * @brief Canary stored in the header of a reserved block. Multiplying by an
+ * odd constant spreads the offset and kval over the whole word, and the low
+ * bit is forced on so a zeroed header never matches. The offset rather than
+ * the address keeps it valid when the arena is mapped elsewhere.
+ *
+ * @param pool the memory pool
+ * @param block the block
+ * @param k the order of the block
+ * @return uint32_t the canary
+ */
+static inline uint32_t block_canary(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    uintptr_t off = (uintptr_t)block - (uintptr_t)pool->base;
+    uint32_t h = (uint32_t)(off >> SMALLEST_K) ^ ((uint32_t)k << 26);
+    return (h * 0x9e3779b1u) | 1;
+}
 
-    // Flip the bit at position buddy->kval
-    uintptr_t buddy_offset = offset ^ (UINT64_C(1) << buddy->kval);
+/**
+ * @brief Bytes of header in front of every user pointer, 0 when block
+ * metadata is kept out of band
+ *
+ * @param pool the memory pool
+ * @return size_t the header size
+ */
+static inline size_t hdr_size(struct buddy_pool *pool)
+{
+    if (pool->flags & (BUDDY_OOB_META | BUDDY_BITTREE)) {
+        return 0;
+    }
+    return (pool->flags & BUDDY_COMPACT) ? sizeof(struct avail_compact) : sizeof(struct avail);
+}
 
-    // Add offset back to base and convert to struct avail*
-    return (struct avail *)(base_addr + buddy_offset);
+/**
+ * @brief Bytes at the start of a free block taken by its tag and list links,
+ * which are never zero. Out of band pools have them too.
+ *
+ * @param pool the memory pool
+ * @return size_t the node size
+ */
+static inline size_t node_size(struct buddy_pool *pool)
+{
+    return (pool->flags & BUDDY_COMPACT) ? sizeof(struct avail_compact) : sizeof(struct avail);
 }
 
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
+/**
+ * @brief Offset link of a block in a BUDDY_COMPACT pool
+ *
+ * @param pool the memory pool
+ * @param block a block in the arena
+ * @return uint32_t the link
+ */
+static inline uint32_t block_link(struct buddy_pool *pool, struct avail *block)
 {
-    if (!pool || size == 0) {
-        return NULL;
-    }
+    return (uint32_t)(((uintptr_t)block - (uintptr_t)pool->base) >> SMALLEST_K);
+}
 
-    // add header to total
-    size_t total = size + sizeof(struct avail);
-    size_t req_k = btok(total);
-    size_t k = req_k;
+/**
+ * @brief Block an offset link of a BUDDY_COMPACT pool refers to
+ *
+ * @param pool the memory pool
+ * @param link the link, not BUDDY_LINK_HEAD
+ * @return struct avail* the block
+ */
+static inline struct avail *link_block(struct buddy_pool *pool, uint32_t link)
+{
+    return (struct avail *)((char *)pool->base + ((size_t)link << SMALLEST_K));
+}
 
-    // Find the first avail index that has a block available
-    while (k < pool->kval_m && pool->avail[k].next == &pool->avail[k]) {
-        k++;
+/**
+ * @brief Next node on avail[k] after node, which may be the list head
+ *
+ * @param pool the memory pool
+ * @param node a free block or the head of avail[k]
+ * @param k the order of the list
+ * @return struct avail* the next node, the head once the list is done
+ */
+static inline struct avail *node_next(struct buddy_pool *pool, struct avail *node, size_t k)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        uint32_t link = ((struct avail_compact *)node)->next;
+        return link == BUDDY_LINK_HEAD ? &pool->avail[k] : link_block(pool, link);
     }
+    return node->next;
+}
 
-    printf("k val after searching for avail block: %zu\n", k);
-    printf("req_k val: %zu\n", req_k);
-    
-    if (pool->avail[k].next == &pool->avail[k]) {
-        errno = ENOMEM;
-        return NULL;
+/**
+ * @brief Node on avail[k] before node, which may be the list head
+ *
+ * @param pool the memory pool
+ * @param node a free block or the head of avail[k]
+ * @param k the order of the list
+ * @return struct avail* the previous node, the head for the first block
+ */
+static inline struct avail *node_prev(struct buddy_pool *pool, struct avail *node, size_t k)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        uint32_t link = ((struct avail_compact *)node)->prev;
+        return link == BUDDY_LINK_HEAD ? &pool->avail[k] : link_block(pool, link);
     }
+    return node->prev;
+}
 
-    struct avail *block = pool->avail[k].next;
-
-    // guard against grabbing the sentinel
-    if (block == &pool->avail[k] || block->tag != BLOCK_AVAIL) {
-        errno = ENOMEM;
-        return NULL; 
+/**
+ * @brief Point node's next link at next, either may be the head of avail[k]
+ *
+ * @param pool the memory pool
+ * @param node the node to change
+ * @param next the node to link to
+ * @param k the order of the list
+ */
+static inline void node_set_next(struct buddy_pool *pool, struct avail *node, struct avail *next,
+                                 size_t k)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        ((struct avail_compact *)node)->next =
+            next == &pool->avail[k] ? BUDDY_LINK_HEAD : block_link(pool, next);
+    } else {
+        node->next = next;
     }
+}
 
-    // Unlink from free list
-    block->prev->next = block->next;
-    block->next->prev = block->prev;  
-
-    // Clean up block's old pointers
-    block->next = NULL;
-    block->prev = NULL;
-
-    // set block->kval even if we don’t split
-    block->kval = k;
+/**
+ * @brief Point node's prev link at prev, either may be the head of avail[k]
+ *
+ * @param pool the memory pool
+ * @param node the node to change
+ * @param prev the node to link to
+ * @param k the order of the list
+ */
+static inline void node_set_prev(struct buddy_pool *pool, struct avail *node, struct avail *prev,
+                                 size_t k)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        ((struct avail_compact *)node)->prev =
+            prev == &pool->avail[k] ? BUDDY_LINK_HEAD : block_link(pool, prev);
+    } else {
+        node->prev = prev;
+    }
+}
 
-    // prevent splitting if block is right size already
-    if (k == req_k) {
-        block->tag = BLOCK_RESERVED;
-        fprintf(stderr, "Returned block has kval=%d\n", block->kval);
-        return (void *)(block + 1); //skip header
+/**
+ * @brief Clear the stale list links out of the header of a block being
+ * handed out. Compact headers end at the links, so only they are touched.
+ *
+ * @param pool the memory pool, must have block headers
+ * @param block the block
+ */
+static inline void block_clear_links(struct buddy_pool *pool, struct avail *block)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        ((struct avail_compact *)block)->next = 0;
+        ((struct avail_compact *)block)->prev = 0;
+    } else {
+        block->next = NULL;
+        block->prev = NULL;
     }
+}
 
-    // Split block down to req_k
-    while (k > req_k) {
-        k--;
-    
-        block->kval = k;
-        struct avail *buddy = buddy_calc(pool, block);
-    
-        buddy->tag = BLOCK_AVAIL;
-        buddy->kval = k;
-    
-        buddy->next = pool->avail[k].next;
-        buddy->prev = &pool->avail[k];
-        pool->avail[k].next->prev = buddy;
-        pool->avail[k].next = buddy;
+/**
+ * @brief Block the shim in front of padded aligned memory leads to. Shims
+ * hold the block's offset, like compact links, so reserved memory never has
+ * an address in it.
+ *
+ * @param pool the memory pool
+ * @param shim the BLOCK_ALIGNED shim
+ * @return struct avail* the block it was written for
+ */
+static inline struct avail *shim_target(struct buddy_pool *pool, struct avail *shim)
+{
+    if (pool->flags & BUDDY_COMPACT) {
+        return link_block(pool, ((struct avail_compact *)shim)->next);
     }
-    
+    return (struct avail *)((char *)pool->base + shim->target);
+}
 
-    block->tag = BLOCK_RESERVED;
-    fprintf(stderr, "Returned block has kval=%d\n", block->kval);
-    return (void *)(block + 1);  // skip header
+/**
+ * @brief Side table entry describing the block that starts at block
+ *
+ * @param pool the memory pool, must have a side table
+ * @param block the block
+ * @return unsigned char* the entry
+ */
+static inline unsigned char *meta_of(struct buddy_pool *pool, struct avail *block)
+{
+    return pool->meta + (((uintptr_t)block - (uintptr_t)pool->base) >> SMALLEST_K);
 }
 
-void buddy_free(struct buddy_pool *pool, void *ptr)
+/**
+ * @brief Bit index of block in the order k maps of a bittree pool
+ */
+static inline size_t bt_index(struct buddy_pool *pool, struct avail *block, size_t k)
 {
-    if (!pool || !ptr) {
-        return;
-    }
+    return ((uintptr_t)block - (uintptr_t)pool->base) >> k;
+}
 
-    //Get the header
-    struct avail *block = ((struct avail *)ptr) - 1;
+/**
+ * @brief Test bit i of map
+ */
+static inline bool bt_test(uint64_t *map, size_t i)
+{
+    return (__atomic_load_n(&map[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+
+/**
+ * @brief Set bit i of map, returning its old value. Atomic because blocks
+ * owned by different threads share words.
+ */
+static inline bool bt_set(uint64_t *map, size_t i)
+{
+    uint64_t bit = UINT64_C(1) << (i & 63);
+    return (__atomic_fetch_or(&map[i >> 6], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
 
-    size_t k = block->kval;
-    block->tag = BLOCK_AVAIL;
+/**
+ * @brief Clear bit i of map
+ */
+static inline void bt_clear(uint64_t *map, size_t i)
+{
+    __atomic_fetch_and(&map[i >> 6], ~(UINT64_C(1) << (i & 63)), __ATOMIC_RELAXED);
+}
 
-    while (k < pool->kval_m) {
-        struct avail *buddy = buddy_calc(pool, block);
+/**
+ * @brief Order of a block in a bittree pool, found by walking the split bits
+ * down from the root along the block's address
+ */
+static inline size_t bt_kval(struct buddy_pool *pool, struct avail *block)
+{
+    size_t k = pool->kval_m;
+    while (k > SMALLEST_K && bt_test(pool->bt->split[k], bt_index(pool, block, k))) {
+        k--;
+    }
+    return k;
+}
 
-        // Make sure buddy is free and same size
-        if (buddy->tag != BLOCK_AVAIL || buddy->kval != k) {
+/**
+ * @brief Mark block as a whole node of order k. Its own split bit is cleared
+ * and every ancestor is marked split, stopping at the first one that already
+ * was since everything above it must be too.
+ */
+static inline void bt_set_node(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (k > SMALLEST_K) {
+        bt_clear(pool->bt->split[k], bt_index(pool, block, k));
+    }
+    for (size_t j = k + 1; j <= pool->kval_m; j++) {
+        if (bt_set(pool->bt->split[j], bt_index(pool, block, j))) {
             break;
         }
+    }
+}
 
-        // Remove buddy from free list
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
+/**
+ * @brief Order of the chunks a lazily committed pool is made writable in
+ */
+static inline size_t commit_k(struct buddy_pool *pool)
+{
+    // mprotect on hugetlb memory has to cover whole huge pages
+    size_t ck = pool->huge_k > BUDDY_COMMIT_K ? pool->huge_k : BUDDY_COMMIT_K;
+    return pool->kval_m < ck ? pool->kval_m : ck;
+}
 
-        // Decide who becomes the parent block (lower address)
-        if (buddy < block) {
-            block = buddy;
-        }
+/**
+ * @brief Check that the chunk holding addr has been committed
+ */
+static inline bool is_committed(struct buddy_pool *pool, void *addr)
+{
+    return !pool->commit_map ||
+           bt_test(pool->commit_map, ((uintptr_t)addr - (uintptr_t)pool->base) >> commit_k(pool));
+}
 
-        k++;
-        block->kval = k;
+/**
+ * @brief Commit every chunk overlapping [addr, addr + len) of a lazily
+ * committed pool. Runs of uncommitted chunks are made writable with one
+ * mprotect before their bits are set, so a thread that sees a bit set can
+ * use the memory. Two threads racing on the same chunk both mprotect it,
+ * which is harmless, and only the one that sets the bit counts it.
+ *
+ * @param pool the memory pool
+ * @param addr start of the range
+ * @param len length of the range in bytes
+ * @return 0 on success, -1 if the kernel refused to commit the memory
+ */
+static int commit_range(struct buddy_pool *pool, void *addr, size_t len)
+{
+    if (!pool->commit_map) {
+        return 0;
     }
 
-    // Insert merged block into free list
-    block->tag = BLOCK_AVAIL;
-    block->next = pool->avail[k].next;
-    block->prev = &pool->avail[k];
-    pool->avail[k].next->prev = block;
-    pool->avail[k].next = block;
+    size_t ck = commit_k(pool);
+    size_t first = ((uintptr_t)addr - (uintptr_t)pool->base) >> ck;
+    size_t last = ((uintptr_t)addr - (uintptr_t)pool->base + len - 1) >> ck;
+    for (size_t c = first; c <= last; c++) {
+        if (bt_test(pool->commit_map, c)) {
+            continue;
+        }
+        size_t end = c + 1;
+        while (end <= last && !bt_test(pool->commit_map, end)) {
+            end++;
+        }
+        if (mprotect((char *)pool->base + (c << ck), (end - c) << ck,
+                     PROT_READ | PROT_WRITE) != 0) {
+            return -1;
+        }
+        for (; c < end; c++) {
+            if (!bt_set(pool->commit_map, c)) {
+                __atomic_add_fetch(&pool->committed, UINT64_C(1) << ck, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return 0;
 }
 
-void buddy_init(struct buddy_pool *pool, size_t size)
+/**
+ * @brief Commit what splitting block from order k down to req_k and handing
+ * out the result touches, the block itself plus the header of every upper
+ * half that lands in a chunk of its own. Does nothing for normal pools.
+ *
+ * @param pool the memory pool
+ * @param block the block about to be split
+ * @param k the order of the block
+ * @param req_k the order it will be split down to
+ * @return 0 on success, -1 if the memory could not be committed
+ */
+static int commit_split(struct buddy_pool *pool, struct avail *block, size_t k, size_t req_k)
 {
-    size_t kval = 0;
-    if (size == 0)
-        kval = DEFAULT_K;
-    else
-        kval = btok(size);
+    if (!pool->commit_map) {
+        return 0;
+    }
+    if (commit_range(pool, block, UINT64_C(1) << req_k) != 0) {
+        return -1;
+    }
+    // Bittree pools never write into free blocks
+    if (pool->bt) {
+        return 0;
+    }
+    // Halves smaller than a chunk share the first chunk with block
+    size_t j = req_k > commit_k(pool) ? req_k : commit_k(pool);
+    for (; j < k; j++) {
+        if (commit_range(pool, (char *)block + (UINT64_C(1) << j), node_size(pool)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    if (kval < MIN_K)
-        kval = MIN_K;
-    if (kval > MAX_K)
-        kval = MAX_K - 1;
+/**
+ * @brief The kval of a free or reserved block. Reserved blocks in out of band
+ * pools have no header, so their kval only lives in the side table.
+ *
+ * @param pool the memory pool
+ * @param block the block
+ * @return size_t the kval
+ */
+static inline size_t block_kval(struct buddy_pool *pool, struct avail *block)
+{
+    if (pool->bt) {
+        return bt_kval(pool, block);
+    }
+    if (pool->meta) {
+        return __atomic_load_n(meta_of(pool, block), __ATOMIC_RELAXED) & META_KVAL;
+    }
+    return block->kval;
+}
 
-    //make sure pool struct is cleared out
-    memset(pool,0,sizeof(struct buddy_pool));
-    pool->kval_m = kval;
-    pool->numbytes = (UINT64_C(1) << pool->kval_m);
-    //Memory map a block of raw memory to manage
-    pool->base = mmap(
-        NULL,                               /*addr to map to*/
-        pool->numbytes,                     /*length*/
-        PROT_READ | PROT_WRITE,             /*prot*/
-        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
-        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
-        0                                   /* offset 0 when using MAP_ANONYMOUS*/
-    );
-    if (MAP_FAILED == pool->base)
-    {
-        handle_error_and_die("buddy_init avail array mmap failed");
+/**
+ * @brief Record that a block we own is reserved at order k. Never writes into
+ * the block itself for out of band pools since the user may already own it.
+ *
+ * @param pool the memory pool
+ * @param block the block
+ * @param k the order of the block
+ */
+static inline void block_set_reserved(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (pool->bt) {
+        bt_set_node(pool, block, k);
+    } else if (pool->meta) {
+        __atomic_store_n(meta_of(pool, block), META(BLOCK_RESERVED, k), __ATOMIC_RELAXED);
+    } else {
+        block->canary = block_canary(pool, block, k);
+        __atomic_store_n(&block->state, avail_state(BLOCK_RESERVED, k), __ATOMIC_RELAXED);
     }
+}
 
-    //Set all blocks to empty. We are using circular lists so the first elements just point
-    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
-    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
-    for (size_t i = 0; i <= kval; i++)
-    {
-        pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
-        pool->avail[i].kval = i;
-        pool->avail[i].tag = BLOCK_UNUSED;
+/**
+ * @brief Record that a block is no longer the start of anything reserved or
+ * free, because it was merged into its buddy, taken off a list or parked in a
+ * magazine. Pointers to it are then caught as double frees by checked pools.
+ * Bittree pools have nothing to record, the split bits already say it.
+ *
+ * @param pool the memory pool
+ * @param block the block
+ * @param k the order of the block
+ */
+static inline void block_set_unused(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (pool->bt) {
+        return;
     }
+    if (pool->meta) {
+        __atomic_store_n(meta_of(pool, block), META(BLOCK_UNUSED, k), __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&block->state, avail_state(BLOCK_UNUSED, k), __ATOMIC_RELAXED);
+    }
+}
 
-    //Add in the first block
-    pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
-    struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
-    m->kval = kval;
-    m->next = m->prev = &pool->avail[kval];
+/**
+ * @brief Offset from which a free block we own is known to be zero, 0 if
+ * nothing is known. Bittree pools have nowhere to keep it.
+ *
+ * @param pool the memory pool
+ * @param block the free block
+ * @return size_t the offset
+ */
+static inline size_t block_zero(struct buddy_pool *pool, struct avail *block)
+{
+    return pool->bt ? 0 : block->zero_from;
 }
 
-void buddy_destroy(struct buddy_pool *pool)
+/**
+ * @brief Record that a free block is zero from offset from to its end, or
+ * that nothing is known when from is 0. Must happen before the block is pushed.
+ *
+ * @param pool the memory pool
+ * @param block the free block
+ * @param from the offset, at least node_size(pool) unless 0
+ */
+static inline void block_set_zero(struct buddy_pool *pool, struct avail *block, size_t from)
 {
-    int rval = munmap(pool->base, pool->numbytes);
-    if (-1 == rval)
-    {
-        handle_error_and_die("buddy_destroy avail array");
+    if (!pool->bt) {
+        block->zero_from = (uint32_t)from;
     }
-    //Zero out the array so it can be reused it needed
-    memset(pool,0,sizeof(struct buddy_pool));
+}
+
+/**
+ * @brief Block a user pointer was carved from. Memory from
+ * buddy_aligned_alloc that had to be padded has a shim header just below the
+ * pointer leading back to the real one.
+ *
+ * @param pool the memory pool
+ * @param ptr the user pointer
+ * @return struct avail* the block
+ */
+static inline struct avail *ptr_block(struct buddy_pool *pool, void *ptr)
+{
+    struct avail *block = (struct avail *)((char *)ptr - hdr_size(pool));
+    if (hdr_size(pool) && block->tag == BLOCK_ALIGNED) {
+        block = shim_target(pool, block);
+    }
+    return block;
+}
+
+/**
+ * @brief Buddy of a block whose order the caller already knows
+ *
+ * @param pool the memory pool
+ * @param block the block
+ * @param k the order of the block
+ * @return struct avail* the buddy
+ */
+static inline struct avail *buddy_of(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    // Convert pointers to raw numbers
+    uintptr_t base_addr = (uintptr_t)(pool->base);
+    uintptr_t block_addr = (uintptr_t)(block);
+
+    // Get how far this block is from the base of memory
+    uintptr_t offset = block_addr - base_addr;
+
+    // Flip the bit at position k
+    uintptr_t buddy_offset = offset ^ (UINT64_C(1) << k);
+
+    // Add offset back to base and convert to struct avail*
+    return (struct avail *)(base_addr + buddy_offset);
+}
+
+ /**
+   * Find the buddy of a given pointer and kval relative to the base address we got from mmap
+   * @param pool The memory pool to work on (needed for the base addresses)
+   * @param buddy The memory block that we want to find the buddy for
+   * @return A pointer to the buddy
+   */
+struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
+{
+    return buddy_of(pool, buddy, block_kval(pool, buddy));
+}
+
+/**
+ * @brief Take one of the pool's spin locks. Pools without BUDDY_CONCURRENT
+ * skip locking entirely.
+ *
+ * @param pool the memory pool
+ * @param lock the lock word
+ */
+static inline void spin_lock(struct buddy_pool *pool, int *lock)
+{
+    if (!(pool->flags & BUDDY_CONCURRENT)) {
+        return;
+    }
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain load so waiters do not bounce the cache line, and
+        // give the holder a chance to run if it has been preempted
+        for (int spins = 0; __atomic_load_n(lock, __ATOMIC_RELAXED); spins++) {
+            if (spins > 64) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+/**
+ * @brief Release a lock taken by spin_lock
+ *
+ * @param pool the memory pool
+ * @param lock the lock word
+ */
+static inline void spin_unlock(struct buddy_pool *pool, int *lock)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Take the spin lock guarding avail[k]
+ *
+ * @param pool the memory pool
+ * @param k the order to lock
+ */
+static inline void order_lock(struct buddy_pool *pool, size_t k)
+{
+    spin_lock(pool, &pool->lock[k]);
+}
+
+/**
+ * @brief Release the spin lock guarding avail[k]
+ *
+ * @param pool the memory pool
+ * @param k the order to unlock
+ */
+static inline void order_unlock(struct buddy_pool *pool, size_t k)
+{
+    spin_unlock(pool, &pool->lock[k]);
+}
+
+/**
+ * @brief Adjust the count of blocks that splits and merges have taken off the
+ * avail lists but not yet put back. Only tracked for concurrent pools.
+ *
+ * @param pool the memory pool
+ * @param delta the amount to add
+ */
+static inline void busy_add(struct buddy_pool *pool, int delta)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        __atomic_add_fetch(&pool->busy, delta, __ATOMIC_ACQ_REL);
+    }
+}
+
+/**
+ * @brief Add n to one of the pool's statistics counters. Concurrent pools
+ * update them atomically since any thread may bump them.
+ *
+ * @param pool the memory pool
+ * @param counter the counter inside pool
+ * @param n the amount to add
+ */
+static inline void stat_add(struct buddy_pool *pool, uint64_t *counter, uint64_t n)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+    } else {
+        *counter += n;
+    }
+}
+
+/**
+ * @brief Push a free block onto the front of avail[k] and mark order k as non-empty.
+ * The caller must hold the lock for order k. The tag and kval are published
+ * last, together, so a concurrent reader never pairs a new tag with an old kval.
+ *
+ * @param pool the memory pool
+ * @param block the block to make available
+ * @param k the order of the block
+ */
+static inline void avail_push(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        __atomic_or_fetch(&pool->avail_mask, UINT64_C(1) << k, __ATOMIC_RELAXED);
+    } else {
+        pool->avail_mask |= UINT64_C(1) << k;
+    }
+    // Only changed under the order lock, atomic so buddy_stats can read it
+    __atomic_store_n(&pool->nfree[k], pool->nfree[k] + 1, __ATOMIC_RELAXED);
+
+    // Bittree pools keep the free set in bitmaps and never touch the block
+    if (pool->bt) {
+        size_t i = bt_index(pool, block, k);
+        bt_set(pool->bt->free[k], i);
+        if ((i >> 6) < pool->bt->hint[k]) {
+            pool->bt->hint[k] = i >> 6;
+        }
+        return;
+    }
+
+    struct avail *head = &pool->avail[k];
+    struct avail *first = node_next(pool, head, k);
+    node_set_next(pool, block, first, k);
+    node_set_prev(pool, block, head, k);
+    node_set_prev(pool, first, block, k);
+    node_set_next(pool, head, block, k);
+    __atomic_store_n(&block->state, avail_state(BLOCK_AVAIL, k), __ATOMIC_RELEASE);
+    if (pool->meta) {
+        __atomic_store_n(meta_of(pool, block), META(BLOCK_AVAIL, k), __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Unlink a free block from its avail list, clearing the order in the mask
+ * when the list becomes empty. The caller must hold the lock for the block's order.
+ *
+ * @param pool the memory pool
+ * @param block the block to unlink
+ * @param k the order of the list it is on
+ */
+static inline void avail_remove(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    bool empty = pool->nfree[k] == 1;
+    __atomic_store_n(&pool->nfree[k], pool->nfree[k] - 1, __ATOMIC_RELAXED);
+    if (pool->bt) {
+        bt_clear(pool->bt->free[k], bt_index(pool, block, k));
+    } else {
+        __atomic_store_n(&block->state, avail_state(BLOCK_UNUSED, k), __ATOMIC_RELAXED);
+        if (pool->meta) {
+            __atomic_store_n(meta_of(pool, block), META(BLOCK_UNUSED, k), __ATOMIC_RELAXED);
+        }
+        struct avail *next = node_next(pool, block, k);
+        struct avail *prev = node_prev(pool, block, k);
+        node_set_next(pool, prev, next, k);
+        node_set_prev(pool, next, prev, k);
+    }
+    if (empty) {
+        if (pool->flags & BUDDY_CONCURRENT) {
+            __atomic_and_fetch(&pool->avail_mask, ~(UINT64_C(1) << k), __ATOMIC_RELAXED);
+        } else {
+            pool->avail_mask &= ~(UINT64_C(1) << k);
+        }
+    }
+}
+
+/**
+ * @brief Check if block is a whole free block of order k. The caller must hold
+ * the lock for order k, which every transition into or out of that state takes.
+ *
+ * @param pool the memory pool
+ * @param block the block header to look at
+ * @param k the order it has to be free at
+ * @return true if the block is on avail[k]
+ */
+static inline bool is_avail(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (pool->bt) {
+        return bt_test(pool->bt->free[k], bt_index(pool, block, k));
+    }
+    if (pool->meta) {
+        return __atomic_load_n(meta_of(pool, block), __ATOMIC_ACQUIRE) == META(BLOCK_AVAIL, k);
+    }
+    return __atomic_load_n(&block->state, __ATOMIC_ACQUIRE) == avail_state(BLOCK_AVAIL, k);
+}
+
+/**
+ * @brief Lowest addressed free block of order k in a bittree pool. The caller
+ * must hold the lock for order k.
+ *
+ * @param pool the memory pool
+ * @param k the order to search
+ * @return the block, or NULL if there is none
+ */
+static struct avail *bt_first(struct buddy_pool *pool, size_t k)
+{
+    struct bittree *bt = pool->bt;
+    size_t words = ((UINT64_C(1) << (pool->kval_m - k)) + 63) >> 6;
+    for (size_t w = bt->hint[k]; w < words; w++) {
+        uint64_t bits = __atomic_load_n(&bt->free[k][w], __ATOMIC_RELAXED);
+        if (bits) {
+            bt->hint[k] = w;
+            size_t i = (w << 6) + lowest_bit(bits);
+            return (struct avail *)((char *)pool->base + (i << k));
+        }
+    }
+    bt->hint[k] = words;
+    return NULL;
+}
+
+/**
+ * @brief Remove the first block from the smallest non-empty avail list at or
+ * above req_k
+ *
+ * @param pool the memory pool
+ * @param req_k the smallest order that can satisfy the request
+ * @param kout set to the order of the block that was taken
+ * @return the block, or NULL if nothing large enough is free
+ */
+static struct avail *avail_take(struct buddy_pool *pool, size_t req_k, size_t *kout)
+{
+    for (;;) {
+        uint64_t usable = __atomic_load_n(&pool->avail_mask, __ATOMIC_RELAXED) &
+                          ~((UINT64_C(1) << req_k) - 1);
+        if (usable == 0) {
+            // Memory another thread is in the middle of splitting or merging
+            // is not on any list yet, wait for it instead of failing
+            if (__atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE) != 0) {
+                sched_yield();
+                continue;
+            }
+            return NULL;
+        }
+
+        size_t k = lowest_bit(usable);
+        order_lock(pool, k);
+        struct avail *block = pool->bt ? bt_first(pool, k) : node_next(pool, &pool->avail[k], k);
+
+        // Another thread emptied the list after we read the mask
+        if (!block || block == &pool->avail[k]) {
+            order_unlock(pool, k);
+            continue;
+        }
+
+        // guard against a corrupted list
+        if (!pool->bt && block->tag != BLOCK_AVAIL) {
+            order_unlock(pool, k);
+            return NULL;
+        }
+
+        avail_remove(pool, block, k);
+        busy_add(pool, 1);
+        order_unlock(pool, k);
+        *kout = k;
+        return block;
+    }
+}
+
+/**
+ * @brief Undo avail_take for a block that could not be used after all
+ *
+ * @param pool the memory pool
+ * @param block the block avail_take returned
+ * @param k the order it was taken at
+ */
+static void avail_putback(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    order_lock(pool, k);
+    avail_push(pool, block, k);
+    order_unlock(pool, k);
+    busy_add(pool, -1);
+}
+
+/**
+ * @brief Split a block that has been taken off avail down to order req_k,
+ * pushing each upper half onto the matching avail list
+ *
+ * @param pool the memory pool
+ * @param block the block to split
+ * @param k the current order of the block
+ * @param req_k the order to split down to
+ * @param zero offset the block was known to be zero from, 0 if unknown
+ * @return size_t the offset the remaining block is known to be zero from
+ */
+static size_t split_down(struct buddy_pool *pool, struct avail *block, size_t k, size_t req_k,
+                         size_t zero)
+{
+    if (k > req_k) {
+        stat_add(pool, &pool->splits, k - req_k);
+    }
+    while (k > req_k) {
+        k--;
+        size_t half = UINT64_C(1) << k;
+        struct avail *upper = buddy_of(pool, block, k);
+
+        // The upper half keeps whatever part of the zero tail it holds, less
+        // the header it is about to get, the lower half only if it reaches in
+        size_t upper_zero = 0;
+        if (zero) {
+            upper_zero = zero > half ? zero - half : 0;
+            if (upper_zero < node_size(pool)) {
+                upper_zero = node_size(pool);
+            }
+        }
+        if (zero >= half) {
+            zero = 0;
+        }
+
+        block_set_reserved(pool, block, k);
+        block_set_zero(pool, upper, upper_zero);
+        order_lock(pool, k);
+        avail_push(pool, upper, k);
+        order_unlock(pool, k);
+    }
+    block_set_reserved(pool, block, k);
+    return zero;
+}
+
+/**
+ * @brief Take a block of order req_k out of the pool, splitting a larger one
+ * if needed
+ *
+ * @param pool the memory pool
+ * @param req_k the order of the block needed
+ * @param size the bytes the caller asked for, only used for tracing
+ * @param zero if not NULL, set to the offset the block is known to be zero
+ * from, 0 if unknown
+ * @return the reserved block, or NULL if nothing large enough is free
+ */
+static struct avail *block_alloc(struct buddy_pool *pool, size_t req_k, size_t size,
+                                 size_t *zero)
+{
+    size_t k = 0;
+    struct avail *block = avail_take(pool, req_k, &k);
+    if (block && commit_split(pool, block, k, req_k) != 0) {
+        avail_putback(pool, block, k);
+        block = NULL;
+    }
+    if (!block) {
+        stat_add(pool, &pool->failures, 1);
+        TRACE(pool, BUDDY_TRACE_FAIL, NULL, size, req_k, 0);
+        return NULL;
+    }
+    stat_add(pool, &pool->allocs, 1);
+    stat_add(pool, &pool->waste, (UINT64_C(1) << req_k) - size);
+    TRACE(pool, BUDDY_TRACE_MALLOC, block, size, req_k, k);
+
+    // Clean up block's old pointers
+    if (hdr_size(pool)) {
+        block_clear_links(pool, block);
+    }
+
+    size_t z = split_down(pool, block, k, req_k, block_zero(pool, block));
+    if (zero) {
+        *zero = z;
+    }
+    busy_add(pool, -1);
+    return block;
+}
+
+/**
+ * @brief System page size, looked up once
+ */
+static size_t page_size(void)
+{
+    static size_t page;
+    if (!page) {
+        page = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    return page;
+}
+
+/**
+ * @brief Hand the pages of a free block back to the OS. The block must not be
+ * on a list, or its list must be locked, so nobody writes to it meanwhile.
+ * List based pools keep the first page since the free list links live there.
+ * Blocks of a page or less in those pools have nothing to give back.
+ *
+ * @param pool the memory pool
+ * @param block the free block
+ * @param k the order of the block
+ * @return size_t the number of bytes released
+ */
+static size_t block_purge(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    size_t page = pool->huge_k ? UINT64_C(1) << pool->huge_k : page_size();
+    size_t skip = pool->bt ? 0 : page;
+    size_t len = UINT64_C(1) << k;
+    if (len < page || len <= skip) {
+        return 0;
+    }
+
+    int advice = MADV_DONTNEED;
+    // Dropped pages of a restored arena read back from the snapshot file
+    bool zeroed = !(pool->flags & BUDDY_RESTORED);
+#ifdef MADV_FREE
+    if (pool->flags & BUDDY_MADV_FREE) {
+        advice = MADV_FREE;
+        zeroed = false;
+    }
+#endif
+    // Shared pages stay in the shm object or file when they are only
+    // unmapped, so punch them out of it instead
+    if (pool->flags & (BUDDY_SHARED | BUDDY_FILE)) {
+#ifdef MADV_REMOVE
+        advice = MADV_REMOVE;
+#else
+        return 0;
+#endif
+    }
+    if (madvise((char *)block + skip, len - skip, advice) != 0) {
+        return 0;
+    }
+    // Dropped pages read back as zero, lazily freed ones might not
+    size_t zero = block_zero(pool, block);
+    if (zeroed && (zero == 0 || zero > skip)) {
+        block_set_zero(pool, block, skip > node_size(pool) ? skip : node_size(pool));
+    }
+    stat_add(pool, &pool->released, len - skip);
+    return len - skip;
+}
+
+/**
+ * @brief Return a reserved block to the pool, merging it with free buddies
+ * as far up as possible
+ *
+ * @param pool the memory pool
+ * @param block the block to release
+ */
+static void block_release(struct buddy_pool *pool, struct avail *block)
+{
+    size_t k = block_kval(pool, block);
+    size_t req_k = k;
+    bool merged = false;
+
+    size_t released = 0;
+
+    // The block stays off the lists until it is pushed so no other thread
+    // tries to merge with it half way up
+    block_set_unused(pool, block, k);
+    order_lock(pool, k);
+    for (;;) {
+        while (k < pool->kval_m) {
+            struct avail *buddy = buddy_of(pool, block, k);
+
+            // Make sure buddy is free and same size
+            if (!is_avail(pool, buddy, k)) {
+                break;
+            }
+
+            // Remove buddy from free list
+            avail_remove(pool, buddy, k);
+            if (!merged) {
+                busy_add(pool, 1);
+                merged = true;
+            }
+            order_unlock(pool, k);
+
+            // Decide who becomes the parent block (lower address)
+            if (buddy < block) {
+                block = buddy;
+            }
+
+            k++;
+            block_set_reserved(pool, block, k);
+            order_lock(pool, k);
+        }
+
+        // Large blocks go back to the OS while nobody else can see them. The
+        // lock is dropped for the syscall, so look for a buddy that was freed
+        // in the meantime again afterwards.
+        if (!pool->release_k || k < pool->release_k || released == k) {
+            break;
+        }
+        order_unlock(pool, k);
+        block_set_zero(pool, block, 0);
+        block_purge(pool, block, k);
+        released = k;
+        order_lock(pool, k);
+    }
+
+    // Insert merged block into free list, only a purge of the whole of it
+    // leaves anything known to be zero
+    if (released != k) {
+        block_set_zero(pool, block, 0);
+    }
+    avail_push(pool, block, k);
+    order_unlock(pool, k);
+    if (merged) {
+        stat_add(pool, &pool->merges, k - req_k);
+        busy_add(pool, -1);
+    }
+    TRACE(pool, BUDDY_TRACE_FREE, block, 0, req_k, k);
+}
+
+/**
+ * @brief Fill out with up to n reserved blocks of order req_k. Instead of
+ * splitting one block per request, a block big enough for as many of the
+ * remaining requests as possible is taken once and cut into siblings.
+ *
+ * @param pool the memory pool
+ * @param req_k the order of each block
+ * @param n the number of blocks wanted
+ * @param out array receiving the block headers
+ * @param size the bytes the caller asked for per block, only used for tracing
+ * @return the number of blocks stored in out
+ */
+static size_t block_alloc_bulk(struct buddy_pool *pool, size_t req_k, size_t n,
+                               struct avail **out, size_t size)
+{
+    size_t got = 0;
+    while (got < n) {
+        // Largest run of siblings that does not overshoot what is left
+        size_t c = req_k + highest_bit(n - got);
+        if (c > pool->kval_m) {
+            c = pool->kval_m;
+        }
+
+        size_t k = 0;
+        struct avail *block = NULL;
+        for (; c >= req_k; c--) {
+            block = avail_take(pool, c, &k);
+            if (block) {
+                break;
+            }
+        }
+        if (block && commit_split(pool, block, k, c) != 0) {
+            avail_putback(pool, block, k);
+            block = NULL;
+        }
+        if (!block) {
+            stat_add(pool, &pool->failures, 1);
+            TRACE(pool, BUDDY_TRACE_FAIL, NULL, size, req_k, 0);
+            break;
+        }
+        TRACE(pool, BUDDY_TRACE_MALLOC, block, size, req_k, k);
+
+        split_down(pool, block, k, c, block_zero(pool, block));
+        busy_add(pool, -1);
+
+        // Cutting a block of order c into siblings is sibs - 1 splits
+        size_t sibs = UINT64_C(1) << (c - req_k);
+        stat_add(pool, &pool->splits, sibs - 1);
+        stat_add(pool, &pool->allocs, sibs);
+        stat_add(pool, &pool->waste, sibs * ((UINT64_C(1) << req_k) - size));
+
+        size_t step = UINT64_C(1) << req_k;
+        for (size_t i = 0; i < sibs; i++) {
+            struct avail *sib = (struct avail *)((char *)block + i * step);
+            block_set_reserved(pool, sib, req_k);
+            if (hdr_size(pool)) {
+                block_clear_links(pool, sib);
+            }
+            out[got++] = sib;
+        }
+    }
+    return got;
+}
+
+/**
+ * @brief Order block headers by address for qsort
+ */
+static int cmp_addr(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Blocks from a sorted run that are waiting for their upper buddy to show up.
+ * Every entry is the lower half of its pair and each one nests inside the
+ * buddy region of the entry below it, so MAX_K entries is always enough.
+ */
+struct merge_stack
+{
+    size_t n;
+    struct avail *blk[MAX_K];
+};
+
+/**
+ * @brief Feed the next block of an address sorted run into the merge stack.
+ * Reserved buddies are joined directly without ever going on an avail list,
+ * anything that can no longer meet its buddy is released to the pool.
+ *
+ * @param pool the memory pool
+ * @param st the merge stack
+ * @param block the next reserved block, at a higher address than the last
+ */
+static void merge_push(struct buddy_pool *pool, struct merge_stack *st, struct avail *block)
+{
+    for (;;) {
+        // Entries whose buddy region lies entirely below block are done
+        while (st->n > 0) {
+            struct avail *top = st->blk[st->n - 1];
+            if ((char *)block < (char *)top + (UINT64_C(2) << block_kval(pool, top))) {
+                break;
+            }
+            block_release(pool, top);
+            st->n--;
+        }
+
+        if (st->n > 0) {
+            struct avail *top = st->blk[st->n - 1];
+            size_t k = block_kval(pool, top);
+            if (k == block_kval(pool, block) && buddy_of(pool, top, k) == block) {
+                st->n--;
+                stat_add(pool, &pool->merges, 1);
+                block_set_unused(pool, block, k);
+                block_set_reserved(pool, top, k + 1);
+                block = top;
+                continue;
+            }
+        }
+
+        // An upper half whose lower half has already gone by can not merge here
+        size_t k = block_kval(pool, block);
+        if (k >= pool->kval_m || buddy_of(pool, block, k) < block) {
+            block_release(pool, block);
+        } else {
+            st->blk[st->n++] = block;
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Release everything left on the merge stack to the pool
+ */
+static void merge_finish(struct buddy_pool *pool, struct merge_stack *st)
+{
+    while (st->n > 0) {
+        block_release(pool, st->blk[--st->n]);
+    }
+}
+
+/**
+ * @brief Magazine of the calling thread for pool, created on first use. The
+ * magazine itself is carved out of the pool so it goes away with buddy_destroy
+ * even if the thread never exits.
+ *
+ * @param pool the memory pool
+ * @return the magazine, or NULL if the pool has no room for one
+ */
+static struct magazine *mag_get(struct buddy_pool *pool)
+{
+    struct magazine *mag = pthread_getspecific(pool->mag_key);
+    if (mag) {
+        return mag;
+    }
+
+    size_t bytes = sizeof(struct magazine) +
+                   sizeof(struct avail *) * BUDDY_MAG_ORDERS * pool->mag_depth;
+    struct avail *block = block_alloc(pool, btok(bytes + hdr_size(pool)), bytes, NULL);
+    if (!block) {
+        return NULL;
+    }
+    mag = (struct magazine *)((char *)block + hdr_size(pool));
+    memset(mag, 0, bytes);
+    mag->pool = pool;
+    pthread_setspecific(pool->mag_key, mag);
+    return mag;
+}
+
+/**
+ * @brief Return all but keep blocks of one magazine order to the pool
+ *
+ * @param mag the magazine
+ * @param i the magazine order index (order - SMALLEST_K)
+ * @param keep the number of blocks to leave cached
+ */
+static void mag_drain(struct magazine *mag, size_t i, unsigned int keep)
+{
+    struct avail **slots = mag->slots + i * mag->pool->mag_depth;
+    if (mag->count[i] <= keep) {
+        return;
+    }
+
+    struct avail **flush = slots + keep;
+    size_t n = mag->count[i] - keep;
+    struct merge_stack st = { 0 };
+    qsort(flush, n, sizeof(struct avail *), cmp_addr);
+    for (size_t j = 0; j < n; j++) {
+        merge_push(mag->pool, &st, flush[j]);
+    }
+    merge_finish(mag->pool, &st);
+    mag->count[i] = keep;
+}
+
+/**
+ * @brief pthread key destructor, hands everything a dead thread cached back to
+ * the pool along with the magazine itself
+ *
+ * @param p the magazine
+ */
+static void mag_destroy(void *p)
+{
+    struct magazine *mag = p;
+    struct buddy_pool *pool = mag->pool;
+    for (size_t i = 0; i < BUDDY_MAG_ORDERS; i++) {
+        mag_drain(mag, i, 0);
+    }
+    block_release(pool, (struct avail *)((char *)mag - hdr_size(pool)));
+}
+
+/**
+ * @brief Hand a rejected pointer to the pool's error callback, or print it and
+ * abort when there is none
+ *
+ * @param pool the memory pool
+ * @param ptr the pointer that was rejected
+ * @param err the BUDDY_ERR_* code
+ */
+static void report_bad_ptr(struct buddy_pool *pool, void *ptr, int err)
+{
+    static const char *why[] = {
+        "?", "outside the pool", "not the start of a block",
+        "already free", "header canary overwritten",
+    };
+    if (pool->on_error) {
+        pool->on_error(pool, ptr, err);
+        return;
+    }
+    fprintf(stderr, "buddy: bad pointer %p for pool %p, %s\n", ptr, (void *)pool,
+            err < 5 ? why[err] : why[0]);
+    abort();
+}
+
+/**
+ * @brief Make sure ptr is a block the caller owns before a checked pool acts
+ * on it. Only the block's own header, or its side table entry or bits, are
+ * read so this costs about as much as the free itself does.
+ *
+ * @param pool the memory pool, must have BUDDY_CHECKED set
+ * @param ptr the user pointer
+ * @return true if ptr is safe to free, false if it was reported
+ */
+static bool ptr_check(struct buddy_pool *pool, void *ptr)
+{
+    uintptr_t base = (uintptr_t)pool->base;
+    uintptr_t addr = (uintptr_t)ptr - hdr_size(pool);
+    int err = 0;
+
+    if ((uintptr_t)ptr < base + hdr_size(pool) || addr - base >= pool->numbytes) {
+        err = BUDDY_ERR_RANGE;
+    } else if (hdr_size(pool) && !(addr & (sizeof(void *) - 1)) &&
+               is_committed(pool, (void *)addr) &&
+               __atomic_load_n(&((struct avail *)addr)->state, __ATOMIC_RELAXED) ==
+               avail_state(BLOCK_ALIGNED, 0)) {
+        // Padded aligned memory, the shim must point at a block below it that
+        // still reaches past the pointer
+        struct avail *shim = (struct avail *)addr;
+        uintptr_t real = (uintptr_t)shim_target(pool, shim);
+        if (shim->canary != block_canary(pool, shim, 0) || real < base || real >= addr) {
+            err = BUDDY_ERR_CANARY;
+        } else {
+            addr = real;
+        }
+    }
+
+    if (err) {
+        // Out of range or a broken shim, nothing more to look at
+    } else if ((addr - base) & ((UINT64_C(1) << SMALLEST_K) - 1) ||
+               !is_committed(pool, (void *)addr)) {
+        // Not even on a block boundary or never handed out, so there is no
+        // header to look at
+        err = BUDDY_ERR_ALIGN;
+    } else {
+        struct avail *block = (struct avail *)addr;
+        struct avail hdr;
+        if (pool->bt) {
+            hdr.kval = (unsigned short int)bt_kval(pool, block);
+            hdr.tag = bt_test(pool->bt->free[hdr.kval], bt_index(pool, block, hdr.kval))
+                      ? BLOCK_AVAIL : BLOCK_RESERVED;
+        } else if (pool->meta) {
+            unsigned char m = __atomic_load_n(meta_of(pool, block), __ATOMIC_RELAXED);
+            hdr.kval = m & META_KVAL;
+            hdr.tag = m >> 6;
+        } else {
+            hdr.state = __atomic_load_n(&block->state, __ATOMIC_RELAXED);
+        }
+
+        if (hdr.kval < SMALLEST_K || hdr.kval > pool->kval_m) {
+            err = BUDDY_ERR_CANARY;
+        } else if ((addr - base) & ((UINT64_C(1) << hdr.kval) - 1)) {
+            err = BUDDY_ERR_ALIGN;
+        } else if (hdr.tag != BLOCK_RESERVED) {
+            err = BUDDY_ERR_FREED;
+        } else if (hdr_size(pool) && block->canary != block_canary(pool, block, hdr.kval)) {
+            err = BUDDY_ERR_CANARY;
+        } else if ((uintptr_t)ptr >= addr + (UINT64_C(1) << hdr.kval)) {
+            // A stale shim pointing at a block that has since shrunk
+            err = BUDDY_ERR_FREED;
+        }
+    }
+
+    if (err) {
+        report_bad_ptr(pool, ptr, err);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Slab class for a request of size bytes, no more than BUDDY_SLAB_MAX
+ */
+static inline size_t slab_class(size_t size)
+{
+    size_t cls = 0;
+    while (slab_sizes[cls] < size) {
+        cls++;
+    }
+    return cls;
+}
+
+/**
+ * @brief Slab that ptr is a slot of, if any
+ *
+ * @param pool the memory pool, must have BUDDY_SLAB
+ * @param ptr the pointer to look up
+ * @return the slab, or NULL if ptr is not in one
+ */
+static inline struct slab *slab_of(struct buddy_pool *pool, void *ptr)
+{
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)pool->base;
+    if (off >= pool->numbytes) {
+        return NULL;
+    }
+    size_t i = off >> BUDDY_SLAB_K;
+    if (!((__atomic_load_n(&pool->slab_map[i >> 6], __ATOMIC_ACQUIRE) >> (i & 63)) & 1)) {
+        return NULL;
+    }
+    return (struct slab *)((char *)pool->base + (i << BUDDY_SLAB_K) + hdr_size(pool));
+}
+
+/**
+ * @brief Set or clear the slab map bit for the slab sized piece at block
+ */
+static inline void slab_mark(struct buddy_pool *pool, struct avail *block, bool set)
+{
+    size_t i = ((uintptr_t)block - (uintptr_t)pool->base) >> BUDDY_SLAB_K;
+    if (set) {
+        __atomic_or_fetch(&pool->slab_map[i >> 6], UINT64_C(1) << (i & 63), __ATOMIC_RELEASE);
+    } else {
+        __atomic_and_fetch(&pool->slab_map[i >> 6], ~(UINT64_C(1) << (i & 63)), __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Put a slab at the front of its class's list. The caller must hold
+ * the class lock.
+ */
+static inline void slab_push(struct buddy_pool *pool, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->slabs[slab->cls];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    pool->slabs[slab->cls] = slab;
+}
+
+/**
+ * @brief Take a slab off its class's list. The caller must hold the class lock.
+ */
+static inline void slab_unlink(struct buddy_pool *pool, struct slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        pool->slabs[slab->cls] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Hand an empty slab's block back to the pool. It must already be off
+ * its class's list.
+ */
+static void slab_destroy(struct buddy_pool *pool, struct slab *slab)
+{
+    struct avail *block = (struct avail *)((char *)slab - hdr_size(pool));
+    slab_mark(pool, block, false);
+    block_release(pool, block);
+}
+
+/**
+ * @brief Cut a fresh block into a slab for class cls
+ *
+ * @param pool the memory pool
+ * @param cls the size class
+ * @return the slab, not yet on any list, or NULL if the pool is out of memory
+ */
+static struct slab *slab_create(struct buddy_pool *pool, size_t cls)
+{
+    size_t bytes = UINT64_C(1) << BUDDY_SLAB_K;
+    struct avail *block = block_alloc(pool, BUDDY_SLAB_K, bytes, NULL);
+    if (!block) {
+        return NULL;
+    }
+
+    struct slab *slab = (struct slab *)((char *)block + hdr_size(pool));
+    uintptr_t first = ((uintptr_t)(slab + 1) + 15) & ~(uintptr_t)15;
+    slab->cls = (unsigned int)cls;
+    slab->slots = (char *)first;
+    slab->nslots = (unsigned int)(((uintptr_t)block + bytes - first) / slab_sizes[cls]);
+    slab->nfree = slab->nslots;
+    memset(slab->free, 0, sizeof(slab->free));
+    for (size_t i = 0; i < slab->nslots; i++) {
+        slab->free[i >> 6] |= UINT64_C(1) << (i & 63);
+    }
+
+    // Published last so a free never finds a half built slab
+    slab_mark(pool, block, true);
+    return slab;
+}
+
+/**
+ * @brief Hand out a slot of class cls, making a new slab if every slab of
+ * the class is full
+ *
+ * @param pool the memory pool
+ * @param cls the size class
+ * @return the slot, or NULL if the pool is out of memory
+ */
+static void *slab_alloc(struct buddy_pool *pool, size_t cls)
+{
+    spin_lock(pool, &pool->slab_lock[cls]);
+    struct slab *slab = pool->slabs[cls];
+    if (!slab) {
+        // Carving a block takes order locks, so not while holding this one
+        spin_unlock(pool, &pool->slab_lock[cls]);
+        slab = slab_create(pool, cls);
+        if (!slab) {
+            return NULL;
+        }
+        spin_lock(pool, &pool->slab_lock[cls]);
+        slab_push(pool, slab);
+    }
+
+    size_t w = 0;
+    while (!slab->free[w]) {
+        w++;
+    }
+    size_t i = (w << 6) + lowest_bit(slab->free[w]);
+    slab->free[w] &= slab->free[w] - 1;
+    if (--slab->nfree == 0) {
+        slab_unlink(pool, slab);
+    }
+    spin_unlock(pool, &pool->slab_lock[cls]);
+    return slab->slots + i * slab_sizes[cls];
+}
+
+/**
+ * @brief Return a slot to its slab. A slab that becomes empty goes back to
+ * the pool unless it is the only one of its class with free slots.
+ *
+ * @param pool the memory pool
+ * @param slab the slab holding ptr
+ * @param ptr the slot
+ */
+static void slab_free(struct buddy_pool *pool, struct slab *slab, void *ptr)
+{
+    size_t cls = slab->cls;
+    size_t off = (uintptr_t)ptr - (uintptr_t)slab->slots;
+    size_t i = off / slab_sizes[cls];
+
+    if (pool->flags & BUDDY_CHECKED &&
+        ((char *)ptr < slab->slots || off % slab_sizes[cls] || i >= slab->nslots)) {
+        report_bad_ptr(pool, ptr, BUDDY_ERR_ALIGN);
+        return;
+    }
+
+    spin_lock(pool, &pool->slab_lock[cls]);
+    uint64_t bit = UINT64_C(1) << (i & 63);
+    if (slab->free[i >> 6] & bit) {
+        spin_unlock(pool, &pool->slab_lock[cls]);
+        if (pool->flags & BUDDY_CHECKED) {
+            report_bad_ptr(pool, ptr, BUDDY_ERR_FREED);
+        }
+        return;
+    }
+    slab->free[i >> 6] |= bit;
+    if (slab->nfree++ == 0) {
+        slab_push(pool, slab);
+    }
+
+    bool release = slab->nfree == slab->nslots && (slab->next || slab->prev);
+    if (release) {
+        slab_unlink(pool, slab);
+    }
+    spin_unlock(pool, &pool->slab_lock[cls]);
+    if (release) {
+        slab_destroy(pool, slab);
+    }
+}
+
+/**
+ * @brief Hand every empty slab back to the pool
+ *
+ * @param pool the memory pool, must have BUDDY_SLAB
+ */
+static void slab_reap(struct buddy_pool *pool)
+{
+    for (size_t cls = 0; cls < BUDDY_SLAB_CLASSES; cls++) {
+        struct slab *empty = NULL;
+        spin_lock(pool, &pool->slab_lock[cls]);
+        for (struct slab *slab = pool->slabs[cls], *next; slab; slab = next) {
+            next = slab->next;
+            if (slab->nfree == slab->nslots) {
+                slab_unlink(pool, slab);
+                slab->next = empty;
+                empty = slab;
+            }
+        }
+        spin_unlock(pool, &pool->slab_lock[cls]);
+
+        while (empty) {
+            struct slab *slab = empty;
+            empty = slab->next;
+            slab_destroy(pool, slab);
+        }
+    }
+}
+
+/**
+ * @brief Lock the list of grown arenas, shared while walking it and
+ * exclusive while adding or removing arenas. Only concurrent pools need it.
+ *
+ * @param pool the pool owning the arenas
+ * @param write true to change the list
+ */
+static inline void arena_lock(struct buddy_pool *pool, bool write)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        if (write) {
+            pthread_rwlock_wrlock(&pool->arena_lock);
+        } else {
+            pthread_rwlock_rdlock(&pool->arena_lock);
+        }
+    }
+}
+
+/**
+ * @brief Release the lock taken by arena_lock
+ *
+ * @param pool the pool owning the arenas
+ */
+static inline void arena_unlock(struct buddy_pool *pool)
+{
+    if (pool->flags & BUDDY_CONCURRENT) {
+        pthread_rwlock_unlock(&pool->arena_lock);
+    }
+}
+
+/**
+ * @brief Check if ptr lies in the pool's own arena, ignoring grown ones
+ */
+static inline bool in_arena(struct buddy_pool *pool, void *ptr)
+{
+    return (uintptr_t)ptr - (uintptr_t)pool->base < pool->numbytes;
+}
+
+/**
+ * @brief Check if an arena is one whole free block
+ */
+static inline bool arena_empty(struct buddy_pool *arena)
+{
+    return __atomic_load_n(&arena->avail_mask, __ATOMIC_RELAXED) == UINT64_C(1) << arena->kval_m;
+}
+
+/**
+ * @brief Check if all an arena holds could be the empty slabs slab_free
+ * keeps, one per class, so that reaping them might leave it empty
+ */
+static bool arena_slabs_only(struct buddy_pool *arena)
+{
+    size_t bytes_free = 0;
+    for (size_t k = SMALLEST_K; k <= arena->kval_m; k++) {
+        bytes_free += __atomic_load_n(&arena->nfree[k], __ATOMIC_RELAXED) << k;
+    }
+    return arena->numbytes - bytes_free <= (size_t)BUDDY_SLAB_CLASSES << BUDDY_SLAB_K;
+}
+
+/**
+ * @brief Grown arena holding ptr. The caller must hold the arena lock.
+ *
+ * @param pool the pool owning the arenas
+ * @param ptr the pointer to look up
+ * @return the arena, or NULL if ptr is in none of them
+ */
+static struct buddy_pool *arena_find(struct buddy_pool *pool, void *ptr)
+{
+    for (struct buddy_pool *arena = pool->next_arena; arena; arena = arena->next_arena) {
+        if (in_arena(arena, ptr)) {
+            return arena;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * One of the allocation entry points, retried on each grown arena. a and b
+ * are its size arguments.
+ */
+typedef void *(*arena_alloc_fn)(struct buddy_pool *arena, size_t a, size_t b);
+
+/**
+ * @brief buddy_malloc in the shape of an arena_alloc_fn
+ */
+static void *arena_malloc(struct buddy_pool *arena, size_t size, size_t unused)
+{
+    (void)unused;
+    return buddy_malloc(arena, size);
+}
+
+/**
+ * @brief Serve a request the pool's own arena turned away from the grown
+ * arenas, mapping a new one when none of them can take it either.
+ *
+ * @param pool the pool owning the arenas
+ * @param fn the allocation to retry
+ * @param a first size argument for fn
+ * @param b second size argument for fn
+ * @param need bytes of block the request takes, to size a new arena
+ * @return the memory, or NULL with errno set
+ */
+static void *arena_alloc(struct buddy_pool *pool, arena_alloc_fn fn, size_t a, size_t b,
+                         size_t need)
+{
+    arena_lock(pool, false);
+    struct buddy_pool *seen = pool->next_arena;
+    for (struct buddy_pool *arena = seen; arena; arena = arena->next_arena) {
+        void *ptr = fn(arena, a, b);
+        if (ptr) {
+            arena_unlock(pool);
+            return ptr;
+        }
+    }
+    arena_unlock(pool);
+
+    // Arenas go up to order MAX_K - 1, a request filling one exactly still fits
+    if (need > UINT64_C(1) << (MAX_K - 1)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Arenas added while the lock was dropped went in front of the ones we tried
+    arena_lock(pool, true);
+    for (struct buddy_pool *arena = pool->next_arena; arena != seen; arena = arena->next_arena) {
+        void *ptr = fn(arena, a, b);
+        if (ptr) {
+            arena_unlock(pool);
+            return ptr;
+        }
+    }
+
+    struct buddy_options opts = {
+        .flags = pool->flags & ~BUDDY_GROW,
+        .on_error = pool->on_error,
+        .release_k = (unsigned int)pool->release_k,
+        .huge_k = (unsigned int)pool->huge_k,
+    };
+    struct buddy_pool *arena = malloc(sizeof(struct buddy_pool));
+    if (!arena || buddy_init_opts(arena, need > pool->numbytes ? need : pool->numbytes,
+                                  &opts) != 0) {
+        free(arena);
+        arena_unlock(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena->next_arena = pool->next_arena;
+    pool->next_arena = arena;
+    pool->narenas++;
+
+    void *ptr = fn(arena, a, b);
+    arena_unlock(pool);
+    return ptr;
+}
+
+/**
+ * @brief Unmap empty grown arenas, leaving the first keep of them mapped
+ *
+ * @param pool the pool owning the arenas
+ * @param keep the number of empty arenas to keep as spares
+ * @return size_t the bytes unmapped
+ */
+static size_t arena_reap(struct buddy_pool *pool, size_t keep)
+{
+    size_t total = 0;
+    arena_lock(pool, true);
+    for (struct buddy_pool **link = &pool->next_arena; *link;) {
+        struct buddy_pool *arena = *link;
+        if (!arena_empty(arena)) {
+            link = &arena->next_arena;
+        } else if (keep > 0) {
+            keep--;
+            link = &arena->next_arena;
+        } else {
+            *link = arena->next_arena;
+            pool->narenas--;
+            total += arena->numbytes;
+            buddy_destroy(arena);
+            free(arena);
+        }
+    }
+    arena_unlock(pool);
+    return total;
+}
+
+/**
+ * @brief Free ptr into the grown arena holding it. If that leaves the arena
+ * empty while another one already is, one of them is unmapped.
+ *
+ * @param pool the pool owning the arenas
+ * @param ptr the pointer to free, outside the pool's own arena
+ */
+static void arena_free(struct buddy_pool *pool, void *ptr)
+{
+    // The shared lock keeps the arena mapped until the free is done with it
+    arena_lock(pool, false);
+    struct buddy_pool *arena = arena_find(pool, ptr);
+    bool empty = false;
+    if (arena) {
+        buddy_free(arena, ptr);
+        // Cached empty slabs would keep the arena from ever looking empty
+        if (arena->flags & BUDDY_SLAB && !arena_empty(arena) && arena_slabs_only(arena)) {
+            slab_reap(arena);
+        }
+        empty = arena_empty(arena);
+    }
+    arena_unlock(pool);
+
+    if (!arena) {
+        if (pool->flags & BUDDY_CHECKED) {
+            report_bad_ptr(pool, ptr, BUDDY_ERR_RANGE);
+        }
+    } else if (empty) {
+        arena_reap(pool, 1);
+    }
+}
+
+/**
+ * @brief buddy_realloc for a pointer in a grown arena. It is resized within
+ * its arena if possible and moved anywhere in the pool otherwise.
+ *
+ * @param pool the pool owning the arenas
+ * @param ptr the pointer to resize, outside the pool's own arena
+ * @param size the new size, not 0
+ * @return the memory, or NULL with errno set
+ */
+static void *arena_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    arena_lock(pool, false);
+    struct buddy_pool *arena = arena_find(pool, ptr);
+    if (!arena) {
+        arena_unlock(pool);
+        if (pool->flags & BUDDY_CHECKED) {
+            report_bad_ptr(pool, ptr, BUDDY_ERR_RANGE);
+        }
+        errno = EINVAL;
+        return NULL;
+    }
+    errno = 0;
+    void *moved = buddy_realloc(arena, ptr, size);
+    int err = errno;
+    size_t usable = moved ? 0 : buddy_usable_size(arena, ptr);
+    arena_unlock(pool);
+    if (moved || err != ENOMEM) {
+        return moved;
+    }
+
+    // Its own arena is full, ptr still holds a block so the arena stays mapped
+    moved = buddy_malloc(pool, size);
+    if (!moved) {
+        return NULL;
+    }
+    memcpy(moved, ptr, usable);
+    buddy_free(pool, ptr);
+    return moved;
+}
+
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    if (!pool || size == 0) {
+        return NULL;
+    }
+
+    // add header to total, anything that can not fit in the pool fails up front
+    size_t hdr = hdr_size(pool);
+    if (size > pool->numbytes - hdr) {
+        if (pool->flags & BUDDY_GROW && size <= SIZE_MAX - hdr) {
+            return arena_alloc(pool, arena_malloc, size, 0, size + hdr);
+        }
+        stat_add(pool, &pool->failures, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t total = size + hdr;
+    size_t req_k = btok(total);
+
+    // Tiny requests share slabs, and take a block of their own order like any
+    // other request when no slab block is left to cut
+    if (pool->flags & BUDDY_SLAB && size <= BUDDY_SLAB_MAX) {
+        void *ptr = slab_alloc(pool, slab_class(size));
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    // Small orders come from the thread's magazine, refilled half way at a time
+    if (pool->mag_depth && req_k < SMALLEST_K + BUDDY_MAG_ORDERS) {
+        struct magazine *mag = mag_get(pool);
+        if (mag) {
+            size_t i = req_k - SMALLEST_K;
+            struct avail **slots = mag->slots + i * pool->mag_depth;
+            if (mag->count[i] == 0) {
+                mag->count[i] = block_alloc_bulk(pool, req_k, (pool->mag_depth + 1) / 2,
+                                                 slots, size);
+            }
+            if (mag->count[i] > 0) {
+                struct avail *block = slots[--mag->count[i]];
+                if (pool->flags & BUDDY_CHECKED) {
+                    block_set_reserved(pool, block, req_k);
+                }
+                return (char *)block + hdr;
+            }
+        }
+    }
+
+    struct avail *block = block_alloc(pool, req_k, size, NULL);
+    if (!block) {
+        if (pool->flags & BUDDY_GROW) {
+            return arena_alloc(pool, arena_malloc, size, 0, total);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    return (char *)block + hdr;  // skip header
+}
+
+void *buddy_calloc(struct buddy_pool *pool, size_t n, size_t size)
+{
+    if (!pool || n == 0 || size == 0) {
+        return NULL;
+    }
+    size_t hdr = hdr_size(pool);
+    size_t bytes = size > SIZE_MAX / n ? SIZE_MAX : n * size;
+    if (bytes > pool->numbytes - hdr) {
+        if (pool->flags & BUDDY_GROW && bytes != SIZE_MAX) {
+            return arena_alloc(pool, buddy_calloc, n, size, bytes + hdr);
+        }
+        stat_add(pool, &pool->failures, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t req_k = btok(bytes + hdr);
+
+    // Slots and magazine blocks have all been used before and are cheap to clear
+    if (pool->bt || (pool->flags & BUDDY_SLAB && bytes <= BUDDY_SLAB_MAX) ||
+        (pool->mag_depth && req_k < SMALLEST_K + BUDDY_MAG_ORDERS)) {
+        void *ptr = buddy_malloc(pool, bytes);
+        if (ptr) {
+            memset(ptr, 0, bytes);
+        }
+        return ptr;
+    }
+
+    size_t zero = 0;
+    struct avail *block = block_alloc(pool, req_k, bytes, &zero);
+    if (!block) {
+        if (pool->flags & BUDDY_GROW) {
+            return arena_alloc(pool, buddy_calloc, n, size, bytes + hdr);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Only clear up to where the block is already known to be zero
+    char *ptr = (char *)block + hdr;
+    size_t dirty = zero ? zero - hdr : bytes;
+    memset(ptr, 0, dirty < bytes ? dirty : bytes);
+    return ptr;
+}
+
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    if (!pool || !ptr) {
+        return;
+    }
+    if (pool->flags & BUDDY_GROW && !in_arena(pool, ptr)) {
+        arena_free(pool, ptr);
+        return;
+    }
+    if (pool->flags & BUDDY_SLAB) {
+        struct slab *slab = slab_of(pool, ptr);
+        if (slab) {
+            slab_free(pool, slab, ptr);
+            return;
+        }
+    }
+    if (pool->flags & BUDDY_CHECKED && !ptr_check(pool, ptr)) {
+        return;
+    }
+
+    //Get the header
+    struct avail *block = ptr_block(pool, ptr);
+
+    // Small blocks go back to the thread's magazine, when it is full half of
+    // it is flushed to the pool in one go
+    size_t k = block_kval(pool, block);
+    if (pool->mag_depth && k < SMALLEST_K + BUDDY_MAG_ORDERS) {
+        struct magazine *mag = mag_get(pool);
+        if (mag) {
+            size_t i = k - SMALLEST_K;
+            if (mag->count[i] == pool->mag_depth) {
+                mag_drain(mag, i, pool->mag_depth / 2);
+            }
+            // Checked pools tag cached blocks so freeing one twice is caught
+            if (pool->flags & BUDDY_CHECKED) {
+                block_set_unused(pool, block, k);
+            }
+            mag->slots[i * pool->mag_depth + mag->count[i]++] = block;
+            return;
+        }
+    }
+
+    block_release(pool, block);
+}
+
+void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size)
+{
+    if (!pool || size == 0) {
+        return NULL;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Blocks of order k sit at multiples of 2^k from the base, so alignments
+    // up to the base's own come from the choice of order alone
+    uintptr_t base = (uintptr_t)pool->base;
+    size_t base_align = (size_t)(base & -base);
+    size_t hdr = hdr_size(pool);
+
+    size_t need = 0;
+    if (hdr == 0) {
+        if (alignment > base_align) {
+            errno = EINVAL;
+            return NULL;
+        }
+        need = size > alignment ? size : alignment;
+    } else if (alignment <= sizeof(void *)) {
+        // The header already leaves user pointers word aligned
+        return buddy_malloc(pool, size);
+    } else {
+        // Pad the front so the pointer lands on the boundary with room for a
+        // shim header below it that clears the block's own. A block is only
+        // as aligned as the base, past that the padding has to cover wherever
+        // the block ends up.
+        size_t pad = (hdr + alignment - 1) & ~(alignment - 1);
+        if (pad != hdr && pad < 2 * hdr) {
+            pad = (2 * hdr + alignment - 1) & ~(alignment - 1);
+        }
+        size_t slack = alignment > base_align ? alignment : 0;
+        need = size > SIZE_MAX - pad - slack ? SIZE_MAX : size + pad + slack;
+    }
+
+    struct avail *block = NULL;
+    if (need <= pool->numbytes) {
+        block = block_alloc(pool, btok(need), size, NULL);
+    }
+    if (!block) {
+        if (pool->flags & BUDDY_GROW && need != SIZE_MAX) {
+            return arena_alloc(pool, buddy_aligned_alloc, alignment, size, need);
+        }
+        if (need > pool->numbytes) {
+            stat_add(pool, &pool->failures, 1);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (hdr == 0) {
+        return block;
+    }
+
+    uintptr_t ptr = ((uintptr_t)block + hdr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (ptr != (uintptr_t)block + hdr && ptr - hdr < (uintptr_t)block + hdr) {
+        // The shim would sit on the links a free writes into the block header
+        ptr = ((uintptr_t)block + 2 * hdr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    if (ptr != (uintptr_t)block + hdr) {
+        struct avail *shim = (struct avail *)(ptr - hdr);
+        if (pool->flags & BUDDY_COMPACT) {
+            ((struct avail_compact *)shim)->next = block_link(pool, block);
+        } else {
+            shim->target = (uint64_t)((char *)block - (char *)pool->base);
+            shim->prev = NULL;
+        }
+        shim->canary = block_canary(pool, shim, 0);
+        __atomic_store_n(&shim->state, avail_state(BLOCK_ALIGNED, 0), __ATOMIC_RELAXED);
+    }
+    return (void *)ptr;
+}
+
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    if (!pool || !ptr) {
+        return 0;
+    }
+    if (pool->flags & BUDDY_GROW && !in_arena(pool, ptr)) {
+        arena_lock(pool, false);
+        struct buddy_pool *arena = arena_find(pool, ptr);
+        size_t usable = arena ? buddy_usable_size(arena, ptr) : 0;
+        arena_unlock(pool);
+        if (!arena && pool->flags & BUDDY_CHECKED) {
+            report_bad_ptr(pool, ptr, BUDDY_ERR_RANGE);
+        }
+        return usable;
+    }
+    if (pool->flags & BUDDY_SLAB) {
+        struct slab *slab = slab_of(pool, ptr);
+        if (slab) {
+            return slab_sizes[slab->cls];
+        }
+    }
+    if (pool->flags & BUDDY_CHECKED && !ptr_check(pool, ptr)) {
+        return 0;
+    }
+
+    // Everything from ptr to the end of its block belongs to the caller
+    struct avail *block = ptr_block(pool, ptr);
+    return (uintptr_t)block + (UINT64_C(1) << block_kval(pool, block)) - (uintptr_t)ptr;
+}
+
+void buddy_magazine_flush(struct buddy_pool *pool)
+{
+    if (!pool || !pool->mag_depth) {
+        return;
+    }
+    struct magazine *mag = pthread_getspecific(pool->mag_key);
+    if (mag) {
+        pthread_setspecific(pool->mag_key, NULL);
+        mag_destroy(mag);
+    }
+}
+
+size_t buddy_malloc_bulk(struct buddy_pool *pool, size_t size, size_t n, void *out[])
+{
+    if (!pool || !out || size == 0 || n == 0) {
+        return 0;
+    }
+    size_t hdr = hdr_size(pool);
+    size_t got = 0;
+    if (size <= pool->numbytes - hdr) {
+        // The headers are written over out and then turned into user pointers
+        struct avail **blocks = (struct avail **)out;
+        got = block_alloc_bulk(pool, btok(size + hdr), n, blocks, size);
+        for (size_t i = 0; i < got; i++) {
+            out[i] = (char *)blocks[i] + hdr;
+        }
+    } else if (!(pool->flags & BUDDY_GROW)) {
+        stat_add(pool, &pool->failures, 1);
+    }
+
+    // Whatever did not fit comes from the grown arenas one at a time
+    if (pool->flags & BUDDY_GROW && size <= SIZE_MAX - hdr) {
+        while (got < n && (out[got] = arena_alloc(pool, arena_malloc, size, 0, size + hdr))) {
+            got++;
+        }
+    }
+    if (got < n) {
+        errno = ENOMEM;
+    }
+    return got;
+}
+
+void buddy_free_bulk(struct buddy_pool *pool, void *ptrs[], size_t n)
+{
+    if (!pool || !ptrs) {
+        return;
+    }
+
+    // Pointers into grown arenas and slab slots are freed one by one, the
+    // merge pass below only knows whole blocks of the pool's own arena
+    if (pool->flags & (BUDDY_GROW | BUDDY_SLAB)) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i] && ((pool->flags & BUDDY_GROW && !in_arena(pool, ptrs[i])) ||
+                            (pool->flags & BUDDY_SLAB && slab_of(pool, ptrs[i])))) {
+                buddy_free(pool, ptrs[i]);
+                ptrs[i] = NULL;
+            }
+        }
+    }
+
+    // Every user pointer lies inside its own block so sorting the pointers
+    // sorts the blocks
+    qsort(ptrs, n, sizeof(void *), cmp_addr);
+
+    struct merge_stack st = { 0 };
+    bool checked = pool->flags & BUDDY_CHECKED;
+    for (size_t i = 0; i < n; i++) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        if (checked) {
+            // Sorting puts a pointer listed twice right next to itself
+            if (i > 0 && ptrs[i] == ptrs[i - 1]) {
+                report_bad_ptr(pool, ptrs[i], BUDDY_ERR_FREED);
+                continue;
+            }
+            if (!ptr_check(pool, ptrs[i])) {
+                continue;
+            }
+        }
+        merge_push(pool, &st, ptr_block(pool, ptrs[i]));
+    }
+    merge_finish(pool, &st);
+}
+
+/**
+ * @brief Try to grow a reserved block to order req_k without moving it. This
+ * only works when the block is the lower half at every order on the way up
+ * and each of those upper buddies is free and whole. Locks are taken in
+ * ascending order, the same order buddy_free walks up in.
+ *
+ * @param pool the memory pool
+ * @param block the reserved block to grow
+ * @param req_k the order the block needs to become
+ * @return true if the block was grown
+ */
+static bool grow_in_place(struct buddy_pool *pool, struct avail *block, size_t req_k)
+{
+    size_t k = block_kval(pool, block);
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+
+    // The block must sit at the start of the 2^req_k block it would become
+    if (req_k > pool->kval_m || (offset & ((UINT64_C(1) << req_k) - 1)) != 0) {
+        return false;
+    }
+
+    for (size_t j = k; j < req_k; j++) {
+        order_lock(pool, j);
+    }
+
+    // Check every buddy before touching anything so a failure leaves the pool alone
+    bool ok = true;
+    for (size_t j = k; j < req_k && ok; j++) {
+        ok = is_avail(pool, (struct avail *)((char *)block + (UINT64_C(1) << j)), j);
+    }
+    if (ok && commit_range(pool, block, UINT64_C(1) << req_k) != 0) {
+        ok = false;
+    }
+
+    if (ok) {
+        for (size_t j = k; j < req_k; j++) {
+            avail_remove(pool, (struct avail *)((char *)block + (UINT64_C(1) << j)), j);
+        }
+        block_set_reserved(pool, block, req_k);
+        stat_add(pool, &pool->merges, req_k - k);
+    }
+
+    for (size_t j = req_k; j > k; j--) {
+        order_unlock(pool, j - 1);
+    }
+    return ok;
+}
+
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (!pool) {
+        return NULL;
+    }
+    if (!ptr) {
+        return buddy_malloc(pool, size);
+    }
+    if (size == 0) {
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+    if (pool->flags & BUDDY_GROW && !in_arena(pool, ptr)) {
+        return arena_realloc(pool, ptr, size);
+    }
+    if (pool->flags & BUDDY_SLAB) {
+        struct slab *slab = slab_of(pool, ptr);
+        if (slab) {
+            // Slots never change size, anything past the class moves
+            size_t usable = slab_sizes[slab->cls];
+            if (size <= usable) {
+                return ptr;
+            }
+            void *moved = buddy_malloc(pool, size);
+            if (moved) {
+                memcpy(moved, ptr, usable);
+                buddy_free(pool, ptr);
+            }
+            return moved;
+        }
+    }
+    if (pool->flags & BUDDY_CHECKED && !ptr_check(pool, ptr)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // Grown pools move anything too large for this arena into another one
+    size_t hdr = hdr_size(pool);
+    if (size > pool->numbytes - hdr && (!(pool->flags & BUDDY_GROW) || size > SIZE_MAX - hdr)) {
+        stat_add(pool, &pool->failures, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct avail *block = ptr_block(pool, ptr);
+    size_t k = block_kval(pool, block);
+    size_t req_k = btok(size + hdr);
+    size_t usable = (uintptr_t)block + (UINT64_C(1) << k) - (uintptr_t)ptr;
+
+    if ((char *)block + hdr != (char *)ptr) {
+        // Padded aligned memory can not be resized around the pointer, it
+        // either still fits or moves
+        if (size <= usable) {
+            return ptr;
+        }
+    } else if (req_k <= k) {
+        // Shrink by handing the upper halves back, they can not merge because
+        // their buddy is the block we are keeping
+        split_down(pool, block, k, req_k, 0);
+        TRACE(pool, BUDDY_TRACE_REALLOC, block, size, req_k, k);
+        return ptr;
+    } else if (grow_in_place(pool, block, req_k)) {
+        TRACE(pool, BUDDY_TRACE_REALLOC, block, size, req_k, k);
+        return ptr;
+    }
+
+    // Fall back to moving the data, the old block stays valid if this fails
+    void *moved = buddy_malloc(pool, size);
+    if (!moved) {
+        return NULL;
+    }
+    memcpy(moved, ptr, usable);
+    buddy_free(pool, ptr);
+    return moved;
+}
+
+/**
+ * @brief Point the map pointers of a bittree at the maps following it in its
+ * mapping and make it the pool's
+ *
+ * @param pool the pool, kval_m must already be set
+ * @param bt the start of the mapping
+ */
+static void bt_layout(struct buddy_pool *pool, struct bittree *bt)
+{
+    uint64_t *next = (uint64_t *)(bt + 1);
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t words = ((UINT64_C(1) << (pool->kval_m - k)) + 63) >> 6;
+        bt->free[k] = next;
+        next += words;
+        if (k > SMALLEST_K) {
+            bt->split[k] = next;
+            next += words;
+        }
+    }
+    pool->bt = bt;
+}
+
+/**
+ * @brief Map the bitmaps for a BUDDY_BITTREE pool. Everything lives in one
+ * MAP_NORESERVE mapping so pages of the larger maps are only faulted in for
+ * the parts of the pool that actually get split.
+ *
+ * @param pool the pool, kval_m must already be set
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int bt_create(struct buddy_pool *pool)
+{
+    size_t bytes = sizeof(struct bittree);
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t words = ((UINT64_C(1) << (pool->kval_m - k)) + 63) >> 6;
+        bytes += words * sizeof(uint64_t) * (k > SMALLEST_K ? 2 : 1);
+    }
+
+    struct bittree *bt = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == bt) {
+        return -1;
+    }
+    bt->bytes = bytes;
+    bt_layout(pool, bt);
+    return 0;
+}
+
+/**
+ * @brief Map the arena for a pool whose kval_m and flags are set. Hugetlb
+ * pools fall back to transparent huge pages and those to normal pages, and
+ * pool->flags is updated to match what was mapped. Lazy pools only reserve
+ * the address range. File backed pools share the file, sized to the pool
+ * here and sparse until the arena is written.
+ *
+ * @param pool the pool being initialized
+ * @param fd the backing file, -1 for anonymous memory
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int map_arena(struct buddy_pool *pool, int fd)
+{
+    bool lazy = pool->flags & BUDDY_LAZY;
+    int prot = lazy ? PROT_NONE : PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (lazy ? MAP_NORESERVE : 0);
+
+    if (fd >= 0) {
+        if (ftruncate(fd, (off_t)pool->numbytes) != 0) {
+            return -1;
+        }
+        void *p = mmap(NULL, pool->numbytes, prot, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == p) {
+            return -1;
+        }
+        pool->base = p;
+        return 0;
+    }
+
+    if (pool->flags & BUDDY_HUGETLB) {
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+        // Never MAP_NORESERVE here, without a reservation the mmap succeeds
+        // even with no huge pages free and the first touch gets SIGBUS
+        if (pool->kval_m >= pool->huge_k) {
+            void *p = mmap(NULL, pool->numbytes, prot,
+                           (flags & ~MAP_NORESERVE) | MAP_HUGETLB |
+                           (int)(pool->huge_k << MAP_HUGE_SHIFT), -1, 0);
+            if (MAP_FAILED != p) {
+                pool->base = p;
+                return 0;
+            }
+        }
+#endif
+        // No huge pages reserved (or none that size), let THP have a go
+        pool->flags = (pool->flags & ~BUDDY_HUGETLB) | BUDDY_HUGE_THP;
+        pool->huge_k = 0;
+    }
+
+    // Over map by one huge page and trim so the arena starts on a huge page
+    size_t align = (pool->flags & BUDDY_HUGE_THP) ? UINT64_C(1) << BUDDY_THP_K : 0;
+    if (align > pool->numbytes) {
+        align = 0;
+    }
+    char *p = mmap(NULL, pool->numbytes + align, prot, flags, -1, 0);
+    if (MAP_FAILED == p) {
+        return -1;
+    }
+    char *start = p;
+    if (align) {
+        start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+        if (start > p) {
+            munmap(p, (size_t)(start - p));
+        }
+        if (p + align > start) {
+            munmap(start + pool->numbytes, (size_t)(p + align - start));
+        }
+    }
+    pool->base = start;
+
+#ifdef MADV_HUGEPAGE
+    if (pool->flags & BUDDY_HUGE_THP && madvise(pool->base, pool->numbytes, MADV_HUGEPAGE) != 0) {
+        pool->flags &= ~BUDDY_HUGE_THP;
+    }
+#else
+    pool->flags &= ~BUDDY_HUGE_THP;
+#endif
+    return 0;
+}
+
+/**
+ * @brief Bytes of the commit bitmap of a BUDDY_LAZY pool
+ */
+static size_t commit_map_bytes(struct buddy_pool *pool)
+{
+    return (((pool->numbytes >> commit_k(pool)) + 63) >> 6) * sizeof(uint64_t);
+}
+
+/**
+ * @brief Bytes of the slab map of a BUDDY_SLAB pool
+ */
+static size_t slab_map_bytes(struct buddy_pool *pool)
+{
+    return (((pool->numbytes >> BUDDY_SLAB_K) + 63) >> 6) * sizeof(uint64_t);
+}
+
+/**
+ * @brief The order of a pool of size bytes, DEFAULT_K for 0 and clamped to
+ * what a pool can be
+ */
+static size_t pool_kval(size_t size)
+{
+    size_t kval = 0;
+    if (size == 0)
+        kval = DEFAULT_K;
+    else
+        kval = btok(size);
+
+    if (kval < MIN_K)
+        kval = MIN_K;
+    if (kval >= MAX_K)
+        kval = MAX_K - 1;
+    return kval;
+}
+
+/**
+ * @brief Set up the avail lists of a pool whose arena is mapped, with the
+ * whole arena as the one free block
+ *
+ * @param pool the pool being initialized
+ */
+static void avail_init(struct buddy_pool *pool)
+{
+    //Set all blocks to empty. We are using circular lists so the first elements just point
+    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
+    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
+    for (size_t i = 0; i <= pool->kval_m; i++)
+    {
+        node_set_next(pool, &pool->avail[i], &pool->avail[i], i);
+        node_set_prev(pool, &pool->avail[i], &pool->avail[i], i);
+        pool->avail[i].kval = i;
+        pool->avail[i].tag = BLOCK_UNUSED;
+    }
+
+    //Add in the first block, fresh from mmap so zero past its header
+    block_set_zero(pool, (struct avail *)pool->base, node_size(pool));
+    avail_push(pool, (struct avail *)pool->base, pool->kval_m);
+}
+
+/**
+ * @brief Undo a partly finished buddy_init_opts, unmapping whatever has been
+ * mapped so far
+ *
+ * @param pool the pool being initialized
+ * @param err the errno to report
+ * @return int always -1
+ */
+static int init_fail(struct buddy_pool *pool, int err)
+{
+    if (pool->slab_map)
+        munmap(pool->slab_map, slab_map_bytes(pool));
+    if (pool->commit_map)
+        munmap(pool->commit_map, commit_map_bytes(pool));
+    if (pool->meta)
+        munmap(pool->meta, pool->numbytes >> SMALLEST_K);
+    if (pool->bt)
+        munmap(pool->bt, pool->bt->bytes);
+    if (pool->base)
+        munmap(pool->base, pool->numbytes);
+    memset(pool,0,sizeof(struct buddy_pool));
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief Everything buddy_init_opts and buddy_init_file have in common
+ *
+ * @param pool the pool to initialize
+ * @param size the size of the pool in bytes
+ * @param opts pool options, NULL for the defaults
+ * @param fd the file to back the arena with, -1 for anonymous memory
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int pool_init(struct buddy_pool *pool, size_t size, const struct buddy_options *opts, int fd)
+{
+    if (opts && ((opts->flags & ~BUDDY_KNOWN_FLAGS) ||
+                 (opts->flags & BUDDY_BITTREE && opts->flags & (BUDDY_OOB_META | BUDDY_COMPACT)) ||
+                 opts->magazine_depth > BUDDY_MAG_MAX_DEPTH ||
+                 (opts->release_k && (opts->release_k >= MAX_K ||
+                                      (UINT64_C(1) << opts->release_k) < page_size())) ||
+                 (opts->huge_k && (opts->huge_k >= MAX_K ||
+                                   (UINT64_C(1) << opts->huge_k) <= page_size()))))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t kval = pool_kval(size);
+    if (opts && opts->flags & BUDDY_COMPACT && kval > BUDDY_COMPACT_MAX_K)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    //make sure pool struct is cleared out
+    memset(pool,0,sizeof(struct buddy_pool));
+    pool->kval_m = kval;
+    pool->numbytes = (UINT64_C(1) << pool->kval_m);
+    pool->flags = opts ? opts->flags : 0;
+    pool->on_error = opts ? opts->on_error : NULL;
+    pool->release_k = opts ? opts->release_k : 0;
+    if (fd >= 0)
+    {
+        //Punching freed blocks out of the file is what keeps it small
+        pool->flags |= BUDDY_FILE;
+        if (!pool->release_k)
+            pool->release_k = BUDDY_FILE_RELEASE_K;
+    }
+    //Memory map a block of raw memory to manage. Lazy pools only reserve the
+    //address range, chunks are committed as blocks in them are handed out
+    if (pool->flags & BUDDY_HUGETLB)
+        pool->huge_k = opts->huge_k ? opts->huge_k : BUDDY_THP_K;
+    if (map_arena(pool, fd) != 0)
+    {
+        return init_fail(pool, errno);
+    }
+
+    //Out of band pools keep one byte of tag/kval for every SMALLEST_K sized
+    //piece of the arena, pages of the table are only touched as blocks appear
+    if (pool->flags & BUDDY_OOB_META)
+    {
+        pool->meta = mmap(NULL, pool->numbytes >> SMALLEST_K, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == pool->meta)
+        {
+            pool->meta = NULL;
+            return init_fail(pool, errno);
+        }
+    }
+
+    if (pool->flags & BUDDY_BITTREE && bt_create(pool) != 0)
+    {
+        return init_fail(pool, errno);
+    }
+
+    if (pool->flags & BUDDY_SLAB)
+    {
+        pool->slab_map = mmap(NULL, slab_map_bytes(pool), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == pool->slab_map)
+        {
+            pool->slab_map = NULL;
+            return init_fail(pool, errno);
+        }
+    }
+
+    if (pool->flags & BUDDY_LAZY)
+    {
+        pool->commit_map = mmap(NULL, commit_map_bytes(pool), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == pool->commit_map)
+        {
+            pool->commit_map = NULL;
+            return init_fail(pool, errno);
+        }
+        //The first block's header is the only thing written up front
+        if (!pool->bt && commit_range(pool, pool->base, node_size(pool)) != 0)
+        {
+            return init_fail(pool, errno);
+        }
+    }
+
+    avail_init(pool);
+
+    if (opts && opts->magazine_depth)
+    {
+        int rval = pthread_key_create(&pool->mag_key, mag_destroy);
+        if (rval != 0)
+        {
+            return init_fail(pool, rval);
+        }
+        pool->mag_depth = opts->magazine_depth;
+    }
+
+    if ((pool->flags & (BUDDY_GROW | BUDDY_CONCURRENT)) == (BUDDY_GROW | BUDDY_CONCURRENT))
+    {
+        int rval = pthread_rwlock_init(&pool->arena_lock, NULL);
+        if (rval != 0)
+        {
+            if (pool->mag_depth)
+                pthread_key_delete(pool->mag_key);
+            return init_fail(pool, rval);
+        }
+    }
+    return 0;
+}
+
+int buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_options *opts)
+{
+    return pool_init(pool, size, opts, -1);
+}
+
+int buddy_init_file(struct buddy_pool *pool, const char *path, size_t size,
+                    const struct buddy_options *opts)
+{
+    //Huge pages and lazy freeing are for anonymous memory, and grown arenas
+    //would not be in the file
+    if (!path || (opts && opts->flags & (BUDDY_MADV_FREE | BUDDY_HUGE_THP | BUDDY_HUGETLB |
+                                         BUDDY_GROW)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+    //The mapping keeps the file open from here on
+    int rval = pool_init(pool, size, opts, fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return rval;
+}
+
+/**
+ * @brief Longest shm_open name a shared pool remembers, terminator included
+ */
+#define SHM_NAME_MAX 256
+
+/**
+ * @brief Marks a shared region whose pool is ready to be opened
+ */
+#define SHM_MAGIC UINT64_C(0x6275646479736863)
+
+/**
+ * @brief Front of the region holding a shared pool, followed by the arena on
+ * the next page. Every process maps the region at the address the creator
+ * got, so the pool header, the free list links and the pointers handed out
+ * mean the same thing in all of them.
+ */
+struct shm_region
+{
+    uint64_t magic;             /*SHM_MAGIC once the creator has set the pool up*/
+    void *addr;                 /*Where the region is mapped in every process*/
+    size_t len;                 /*Bytes in the region, arena included*/
+    char name[SHM_NAME_MAX];    /*shm_open name, empty for anonymous regions*/
+    struct buddy_pool pool;
+};
+
+/**
+ * @brief The region a BUDDY_SHARED pool lives in
+ */
+static inline struct shm_region *shm_region_of(struct buddy_pool *pool)
+{
+    return (struct shm_region *)((char *)pool - offsetof(struct shm_region, pool));
+}
+
+/**
+ * @brief Undo a partly finished buddy_init_shared
+ *
+ * @param name the shm_open name, NULL for anonymous regions
+ * @param fd the shm object, -1 if it was not created
+ * @param err the errno to report
+ * @return always NULL
+ */
+static struct buddy_pool *shm_fail(const char *name, int fd, int err)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        shm_unlink(name);
+    }
+    errno = err;
+    return NULL;
+}
+
+struct buddy_pool *buddy_init_shared(const char *name, size_t size, const struct buddy_options *opts)
+{
+    if (opts && ((opts->flags & ~BUDDY_SHARED_FLAGS) || opts->magazine_depth ||
+                 opts->on_error || opts->huge_k ||
+                 (opts->release_k && (opts->release_k >= MAX_K ||
+                                      (UINT64_C(1) << opts->release_k) < page_size()))))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (name && strlen(name) >= SHM_NAME_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    size_t kval = pool_kval(size);
+    if (opts && opts->flags & BUDDY_COMPACT && kval > BUDDY_COMPACT_MAX_K)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t page = page_size();
+    size_t hdr = (sizeof(struct shm_region) + page - 1) & ~(page - 1);
+    size_t len = hdr + (UINT64_C(1) << kval);
+
+    //Named regions can be opened by any process, anonymous ones are only
+    //inherited by children forked after this
+    int fd = -1;
+    if (name)
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return NULL;
+        if (ftruncate(fd, (off_t)len) != 0)
+            return shm_fail(name, fd, errno);
+    }
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | (name ? 0 : MAP_ANONYMOUS), fd, 0);
+    if (MAP_FAILED == p)
+        return shm_fail(name, fd, errno);
+    if (fd >= 0)
+        close(fd);
+
+    //The region is fresh and zero, so only the non-zero fields are set
+    struct shm_region *region = (struct shm_region *)p;
+    region->addr = p;
+    region->len = len;
+    if (name)
+        strcpy(region->name, name);
+
+    struct buddy_pool *pool = &region->pool;
+    pool->kval_m = kval;
+    pool->numbytes = UINT64_C(1) << kval;
+    pool->base = p + hdr;
+    pool->flags = (opts ? opts->flags : 0) | BUDDY_CONCURRENT | BUDDY_SHARED;
+    pool->release_k = opts ? opts->release_k : 0;
+    avail_init(pool);
+
+    __atomic_store_n(&region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return pool;
+}
+
+struct buddy_pool *buddy_open_shared(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    //The region is mapped where the creator has it, so read that first
+    struct shm_region head = { 0 };
+    ssize_t n = pread(fd, &head, offsetof(struct shm_region, pool), 0);
+    if (n != (ssize_t)offsetof(struct shm_region, pool) || head.magic != SHM_MAGIC)
+    {
+        //Short or unmarked means the creator has not finished yet
+        int err = n < 0 ? errno : head.magic ? EINVAL : EAGAIN;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void *p = mmap(head.addr, head.len, PROT_READ | PROT_WRITE, flags, fd, 0);
+    int err = errno;
+    close(fd);
+    if (MAP_FAILED == p)
+    {
+        errno = err;
+        return NULL;
+    }
+    //Without MAP_FIXED_NOREPLACE the address is only a hint
+    if (p != head.addr)
+    {
+        munmap(p, head.len);
+        errno = EEXIST;
+        return NULL;
+    }
+
+    //Pairs with the creator's release store, the pool is ready before it
+    struct shm_region *region = p;
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC)
+    {
+        munmap(p, head.len);
+        errno = EINVAL;
+        return NULL;
+    }
+    return &region->pool;
+}
+
+void buddy_close_shared(struct buddy_pool *pool)
+{
+    if (!pool || !(pool->flags & BUDDY_SHARED))
+        return;
+
+    struct shm_region *region = shm_region_of(pool);
+    if (-1 == munmap(region->addr, region->len))
+    {
+        handle_error_and_die("buddy_close_shared region");
+    }
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    if (buddy_init_opts(pool, size, NULL) != 0)
+    {
+        handle_error_and_die("buddy_init avail array mmap failed");
+    }
+}
+
+void buddy_destroy(struct buddy_pool *pool)
+{
+    //Shared pools live in their region, processes that still map it keep it
+    if (pool->flags & BUDDY_SHARED)
+    {
+        struct shm_region *region = shm_region_of(pool);
+        if (region->name[0])
+            shm_unlink(region->name);
+        buddy_close_shared(pool);
+        return;
+    }
+    //Grown arenas are pools of their own
+    if (pool->flags & BUDDY_GROW)
+    {
+        while (pool->next_arena)
+        {
+            struct buddy_pool *arena = pool->next_arena;
+            pool->next_arena = arena->next_arena;
+            buddy_destroy(arena);
+            free(arena);
+        }
+        if (pool->flags & BUDDY_CONCURRENT)
+        {
+            pthread_rwlock_destroy(&pool->arena_lock);
+        }
+    }
+    //Magazines live inside the pool so dropping the key is all the cleanup they need
+    if (pool->mag_depth)
+    {
+        pthread_key_delete(pool->mag_key);
+    }
+#ifdef MADV_REMOVE
+    //Whatever is left in the file is garbage now, give its space back
+    if (pool->flags & BUDDY_FILE)
+    {
+        madvise(pool->base, pool->numbytes, MADV_REMOVE);
+    }
+#endif
+    int rval = munmap(pool->base, pool->numbytes);
+    if (-1 == rval)
+    {
+        handle_error_and_die("buddy_destroy avail array");
+    }
+    if (pool->meta && -1 == munmap(pool->meta, pool->numbytes >> SMALLEST_K))
+    {
+        handle_error_and_die("buddy_destroy side table");
+    }
+    if (pool->bt && -1 == munmap(pool->bt, pool->bt->bytes))
+    {
+        handle_error_and_die("buddy_destroy bittree");
+    }
+    if (pool->commit_map && -1 == munmap(pool->commit_map, commit_map_bytes(pool)))
+    {
+        handle_error_and_die("buddy_destroy commit map");
+    }
+    if (pool->slab_map && -1 == munmap(pool->slab_map, slab_map_bytes(pool)))
+    {
+        handle_error_and_die("buddy_destroy slab map");
+    }
+    //Zero out the array so it can be reused it needed
+    memset(pool,0,sizeof(struct buddy_pool));
+}
+
+size_t buddy_trim(struct buddy_pool *pool)
+{
+    if (!pool) {
+        return 0;
+    }
+
+    if (pool->flags & BUDDY_SLAB) {
+        slab_reap(pool);
+    }
+
+    // Empty grown arenas go altogether, the rest are trimmed like this one
+    size_t total = 0;
+    if (pool->flags & BUDDY_GROW) {
+        // Their cached slabs go first, or the arenas would never look empty
+        if (pool->flags & BUDDY_SLAB) {
+            arena_lock(pool, false);
+            for (struct buddy_pool *arena = pool->next_arena; arena; arena = arena->next_arena) {
+                slab_reap(arena);
+            }
+            arena_unlock(pool);
+        }
+        total += arena_reap(pool, 0);
+        arena_lock(pool, false);
+        for (struct buddy_pool *arena = pool->next_arena; arena; arena = arena->next_arena) {
+            total += buddy_trim(arena);
+        }
+        arena_unlock(pool);
+    }
+
+    // Holding an order's lock keeps every block on it where it is
+    for (size_t k = pool->kval_m; (UINT64_C(1) << k) >= page_size() && k >= SMALLEST_K; k--) {
+        order_lock(pool, k);
+        if (pool->bt) {
+            size_t words = ((UINT64_C(1) << (pool->kval_m - k)) + 63) >> 6;
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = pool->bt->free[k][w]; bits; bits &= bits - 1) {
+                    size_t i = (w << 6) + lowest_bit(bits);
+                    total += block_purge(pool, (struct avail *)((char *)pool->base + (i << k)), k);
+                }
+            }
+        } else {
+            for (struct avail *b = node_next(pool, &pool->avail[k], k); b != &pool->avail[k];
+                 b = node_next(pool, b, k)) {
+                total += block_purge(pool, b, k);
+            }
+        }
+        order_unlock(pool, k);
+    }
+    return total;
+}
+
+/**
+ * @brief Add the usage of one arena to out
+ *
+ * @param pool the arena
+ * @param out the totals so far
+ */
+static void stats_add(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    size_t bytes_free = 0;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t n = __atomic_load_n(&pool->nfree[k], __ATOMIC_RELAXED);
+        out->free_blocks[k] += n;
+        bytes_free += n << k;
+        if (n && (UINT64_C(1) << k) > out->largest_free) {
+            out->largest_free = UINT64_C(1) << k;
+        }
+    }
+    out->free += bytes_free;
+    out->allocated += pool->numbytes - bytes_free;
+    out->committed += pool->commit_map ? __atomic_load_n(&pool->committed, __ATOMIC_RELAXED)
+                                       : pool->numbytes;
+    out->allocs += __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+    out->splits += __atomic_load_n(&pool->splits, __ATOMIC_RELAXED);
+    out->merges += __atomic_load_n(&pool->merges, __ATOMIC_RELAXED);
+    out->failures += __atomic_load_n(&pool->failures, __ATOMIC_RELAXED);
+    out->internal_frag += __atomic_load_n(&pool->waste, __ATOMIC_RELAXED);
+    out->released += __atomic_load_n(&pool->released, __ATOMIC_RELAXED);
+}
+
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    memset(out, 0, sizeof(struct buddy_stats));
+    if (!pool) {
+        return;
+    }
+
+    stats_add(pool, out);
+    if (pool->flags & BUDDY_GROW) {
+        arena_lock(pool, false);
+        for (struct buddy_pool *arena = pool->next_arena; arena; arena = arena->next_arena) {
+            stats_add(arena, out);
+        }
+        out->arenas = pool->narenas;
+        arena_unlock(pool);
+    }
+}
+
+/**
+ * @brief Marks a pool snapshot file
+ */
+#define SNAP_MAGIC UINT64_C(0x6275646479736e70)
+
+/**
+ * @brief Front of a snapshot file. The arena follows at arena_off and the
+ * side table or bittree maps, if the pool has either, at meta_off. Both are
+ * page aligned so buddy_restore can map them straight from the file.
+ */
+struct snap_header
+{
+    uint64_t magic;             /*SNAP_MAGIC*/
+    uint64_t pool_bytes;        /*sizeof(struct buddy_pool) of the writer*/
+    uint64_t arena_off;         /*File offset of the arena*/
+    uint64_t meta_off;          /*File offset of the side table or bittree, 0 for none*/
+    uint64_t meta_bytes;        /*Length of the side table or bittree*/
+    uint64_t old_pool;          /*Address of the pool, to recognize links to its list heads*/
+    struct buddy_pool pool;     /*The pool as it was, addresses only mean something with old_pool*/
+};
+
+/**
+ * @brief Order free block records, offsets with the order in the low bits
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Write len bytes at file offset off, leaving the pages that are all
+ * zero as holes so a mostly empty pool makes a sparse file. The file must
+ * already be long enough.
+ *
+ * @param fd the file
+ * @param buf the bytes to write
+ * @param len the number of bytes
+ * @param off the file offset, page aligned whenever buf is
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int snap_write(int fd, const char *buf, size_t len, uint64_t off)
+{
+    size_t page = page_size();
+    while (len) {
+        // Skip zero pages, then gather the run of pages that are not
+        size_t n = page - ((uintptr_t)buf & (page - 1));
+        n = n < len ? n : len;
+        if (buf[0] == 0 && memcmp(buf, buf + 1, n - 1) == 0) {
+            buf += n;
+            off += n;
+            len -= n;
+            continue;
+        }
+        while (n < len) {
+            size_t next = len - n < page ? len - n : page;
+            if (buf[n] == 0 && memcmp(buf + n, buf + n + 1, next - 1) == 0) {
+                break;
+            }
+            n += next;
+        }
+
+        ssize_t done = pwrite(fd, buf, n, (off_t)off);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += done;
+        off += (uint64_t)done;
+        len -= (size_t)done;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the arena of a pool into its snapshot. Only reserved memory
+ * and the headers of free blocks matter, so the free blocks are collected
+ * and sorted and just the gaps between them are written. The rest of the
+ * file stays a hole and reads back as zero, which every free block's
+ * zero_from agrees with.
+ *
+ * @param pool the memory pool
+ * @param fd the snapshot file
+ * @param off the file offset of the arena
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int snap_arena(struct buddy_pool *pool, int fd, uint64_t off)
+{
+    size_t n = 0;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        n += pool->nfree[k];
+    }
+    uint64_t *blocks = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!blocks) {
+        return -1;
+    }
+
+    // Free blocks start a multiple of 2^SMALLEST_K in, which leaves room
+    // for their order in the low bits
+    size_t got = 0;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        if (pool->bt) {
+            size_t words = ((UINT64_C(1) << (pool->kval_m - k)) + 63) >> 6;
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = pool->bt->free[k][w]; bits && got < n; bits &= bits - 1) {
+                    blocks[got++] = ((uint64_t)((w << 6) + lowest_bit(bits)) << k) | k;
+                }
+            }
+        } else {
+            for (struct avail *b = node_next(pool, &pool->avail[k], k);
+                 b != &pool->avail[k] && got < n; b = node_next(pool, b, k)) {
+                blocks[got++] = (uint64_t)((char *)b - (char *)pool->base) | k;
+            }
+        }
+    }
+    qsort(blocks, got, sizeof(uint64_t), cmp_u64);
+
+    char *base = pool->base;
+    uint64_t pos = 0;
+    int rval = 0;
+    for (size_t i = 0; i <= got && rval == 0; i++) {
+        uint64_t start = i < got ? blocks[i] & ~(uint64_t)63 : pool->numbytes;
+        rval = snap_write(fd, base + pos, start - pos, off + pos);
+        if (i < got) {
+            pos = start + (UINT64_C(1) << (blocks[i] & 63));
+            if (!pool->bt && rval == 0) {
+                rval = snap_write(fd, base + start, node_size(pool), off + start);
+            }
+        }
+    }
+    free(blocks);
+    return rval;
+}
+
+int buddy_snapshot(struct buddy_pool *pool, const char *path)
+{
+    if (!pool || !path || pool->flags & (BUDDY_GROW | BUDDY_SLAB | BUDDY_SHARED))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    buddy_magazine_flush(pool);
+
+    struct snap_header *hdr = calloc(1, sizeof(struct snap_header));
+    if (!hdr)
+        return -1;
+    size_t page = page_size();
+    hdr->magic = SNAP_MAGIC;
+    hdr->pool_bytes = sizeof(struct buddy_pool);
+    hdr->arena_off = (sizeof(struct snap_header) + page - 1) & ~(uint64_t)(page - 1);
+    hdr->old_pool = (uint64_t)(uintptr_t)pool;
+    hdr->pool = *pool;
+    const void *meta = NULL;
+    if (pool->meta)
+    {
+        meta = pool->meta;
+        hdr->meta_bytes = pool->numbytes >> SMALLEST_K;
+    }
+    else if (pool->bt)
+    {
+        meta = pool->bt;
+        hdr->meta_bytes = pool->bt->bytes;
+    }
+    if (meta)
+        hdr->meta_off = hdr->arena_off + pool->numbytes;
+    uint64_t len = hdr->arena_off + pool->numbytes + hdr->meta_bytes;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int rval = fd < 0 ? -1 : 0;
+    if (rval == 0)
+        rval = ftruncate(fd, (off_t)len);
+    if (rval == 0)
+        rval = snap_write(fd, (const char *)hdr, sizeof(struct snap_header), 0);
+    if (rval == 0)
+        rval = snap_arena(pool, fd, hdr->arena_off);
+    if (rval == 0 && meta)
+        rval = snap_write(fd, meta, hdr->meta_bytes, hdr->meta_off);
+
+    int err = errno;
+    free(hdr);
+    if (fd >= 0 && close(fd) != 0 && rval == 0)
+    {
+        err = errno;
+        rval = -1;
+    }
+    errno = err;
+    return rval;
+}
+
+/**
+ * @brief Point the avail lists of a restored pointer linked pool at its new
+ * heads, and at the new arena if it moved. Links to the old heads are found
+ * by the old pool address. An arena that did not move only needs the first
+ * and last block of each list fixed, one that did has every free block
+ * rewritten.
+ *
+ * @param pool the restored pool
+ * @param old_pool the address of the pool the snapshot was taken of
+ * @param old_base the arena address of the pool the snapshot was taken of
+ */
+static void snap_relocate(struct buddy_pool *pool, uintptr_t old_pool, uintptr_t old_base)
+{
+    uintptr_t delta = (uintptr_t)pool->base - old_base;
+    for (size_t k = 0; k <= pool->kval_m; k++) {
+        struct avail *head = &pool->avail[k];
+        uintptr_t old_head = old_pool + offsetof(struct buddy_pool, avail) + k * sizeof(struct avail);
+        struct avail *node = head;
+        do {
+            uintptr_t next = (uintptr_t)node->next;
+            uintptr_t prev = (uintptr_t)node->prev;
+            node->next = next == old_head ? head : (struct avail *)(next + delta);
+            node->prev = prev == old_head ? head : (struct avail *)(prev + delta);
+            if (!delta && node == head && node->next != head) {
+                // Only the ends of the list link to the head
+                node->next->prev = head;
+                node->prev->next = head;
+                break;
+            }
+            node = node->next;
+        } while (node != head);
+    }
+}
+
+int buddy_restore(struct buddy_pool *pool, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct snap_header *hdr = calloc(1, sizeof(struct snap_header));
+    struct stat st;
+    int err = EINVAL;
+    if (!hdr)
+    {
+        err = errno;
+    }
+    else if (fstat(fd, &st) != 0)
+    {
+        err = errno;
+    }
+    else if (pread(fd, hdr, sizeof(struct snap_header), 0) == (ssize_t)sizeof(struct snap_header) &&
+             hdr->magic == SNAP_MAGIC && hdr->pool_bytes == sizeof(struct buddy_pool) &&
+             hdr->pool.kval_m >= MIN_K && hdr->pool.kval_m < MAX_K &&
+             hdr->pool.numbytes == UINT64_C(1) << hdr->pool.kval_m &&
+             (uint64_t)st.st_size >= hdr->arena_off + hdr->pool.numbytes + hdr->meta_bytes)
+    {
+        err = 0;
+    }
+    if (err)
+    {
+        free(hdr);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    //Only the list state carries over, everything tied to the old process
+    //or its mappings starts over
+    struct buddy_pool *old = &hdr->pool;
+    memset(pool, 0, sizeof(struct buddy_pool));
+    pool->kval_m = old->kval_m;
+    pool->numbytes = old->numbytes;
+    pool->avail_mask = old->avail_mask;
+    pool->flags = (old->flags & ~(BUDDY_LAZY | BUDDY_HUGE_THP | BUDDY_HUGETLB | BUDDY_FILE)) |
+                  BUDDY_RESTORED;
+    pool->release_k = old->release_k;
+    memcpy(pool->nfree, old->nfree, sizeof(pool->nfree));
+    pool->allocs = old->allocs;
+    pool->splits = old->splits;
+    pool->merges = old->merges;
+    pool->failures = old->failures;
+    pool->waste = old->waste;
+    pool->released = old->released;
+    memcpy(pool->avail, old->avail, sizeof(pool->avail));
+
+    //Pointer linked lists are cheapest to fix where they were, offset
+    //linked ones work anywhere
+    void *want = NULL;
+    int flags = MAP_PRIVATE;
+    if (!(old->flags & (BUDDY_COMPACT | BUDDY_BITTREE)))
+    {
+        want = old->base;
+#ifdef MAP_FIXED_NOREPLACE
+        flags |= MAP_FIXED_NOREPLACE;
+#endif
+    }
+    void *base = mmap(want, pool->numbytes, PROT_READ | PROT_WRITE, flags, fd, (off_t)hdr->arena_off);
+    if (MAP_FAILED == base && want)
+        base = mmap(NULL, pool->numbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    (off_t)hdr->arena_off);
+    if (MAP_FAILED != base)
+    {
+        pool->base = base;
+        void *meta = NULL;
+        if (hdr->meta_off)
+            meta = mmap(NULL, hdr->meta_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                        (off_t)hdr->meta_off);
+        if (MAP_FAILED == meta)
+            err = errno;
+        else if (old->flags & BUDDY_BITTREE)
+            bt_layout(pool, meta);
+        else
+            pool->meta = meta;
+    }
+    else
+    {
+        err = errno;
+    }
+
+    if (err)
+    {
+        free(hdr);
+        close(fd);
+        return init_fail(pool, err);
+    }
+    if (!pool->bt && !(pool->flags & BUDDY_COMPACT))
+        snap_relocate(pool, (uintptr_t)hdr->old_pool, (uintptr_t)old->base);
+    free(hdr);
+    close(fd);
+    return 0;
+}
+
+size_t buddy_trace_snapshot(struct buddy_trace_rec *out, size_t max)
+{
+#ifdef BUDDY_TRACE
+    uint64_t last = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t first = last > BUDDY_TRACE_SLOTS ? last - BUDDY_TRACE_SLOTS + 1 : 1;
+    size_t n = 0;
+
+    for (uint64_t seq = first; seq <= last && n < max; seq++) {
+        struct buddy_trace_rec *rec = &trace_ring[seq & (BUDDY_TRACE_SLOTS - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq) {
+            continue;
+        }
+        out[n] = *rec;
+        //Drop the copy if a writer reused the slot while we were reading it
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+            out[n].seq = seq;
+            n++;
+        }
+    }
+    return n;
+#else
+    (void)out;
+    (void)max;
+    return 0;
+#endif
+}
+
+void buddy_trace_dump(FILE *out)
+{
+    static const char *names[] = { "?", "malloc", "free", "fail", "resize" };
+    struct buddy_trace_rec *recs = malloc(sizeof(struct buddy_trace_rec) * BUDDY_TRACE_SLOTS);
+    if (!recs) {
+        return;
+    }
+
+    size_t n = buddy_trace_snapshot(recs, BUDDY_TRACE_SLOTS);
+    for (size_t i = 0; i < n; i++) {
+        struct buddy_trace_rec *r = &recs[i];
+        fprintf(out, "%llu %llu.%09llu pool=0x%llx %-6s off=0x%llx size=%llu req_k=%u kval=%u\n",
+                (unsigned long long)r->seq,
+                (unsigned long long)(r->ns / 1000000000u),
+                (unsigned long long)(r->ns % 1000000000u),
+                (unsigned long long)r->pool,
+                r->op < 5 ? names[r->op] : names[0],
+                (unsigned long long)r->offset,
+                (unsigned long long)r->size,
+                r->req_k, r->kval);
+    }
+    free(recs);
 }
 
 #define UNUSED(x) (void)x
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
@@ -34,9 +36,77 @@ extern "C"
    */
 #define SMALLEST_K 6
 
+  /**
+   * Compile time version of btok for use in constant expressions such as
+   * static size class tables and _Static_assert. Evaluates bytes many times
+   * so only pass it constants.
+   */
+#define BTOK_FITS_(bytes, k) ((uint64_t)(bytes) <= (UINT64_C(1) << (k)))
+#define BTOK_CONST(bytes)                       \
+  (BTOK_FITS_(bytes, SMALLEST_K) ? SMALLEST_K : \
+   BTOK_FITS_(bytes, 7) ? 7 :                   \
+   BTOK_FITS_(bytes, 8) ? 8 :                   \
+   BTOK_FITS_(bytes, 9) ? 9 :                   \
+   BTOK_FITS_(bytes, 10) ? 10 :                 \
+   BTOK_FITS_(bytes, 11) ? 11 :                 \
+   BTOK_FITS_(bytes, 12) ? 12 :                 \
+   BTOK_FITS_(bytes, 13) ? 13 :                 \
+   BTOK_FITS_(bytes, 14) ? 14 :                 \
+   BTOK_FITS_(bytes, 15) ? 15 :                 \
+   BTOK_FITS_(bytes, 16) ? 16 :                 \
+   BTOK_FITS_(bytes, 17) ? 17 :                 \
+   BTOK_FITS_(bytes, 18) ? 18 :                 \
+   BTOK_FITS_(bytes, 19) ? 19 :                 \
+   BTOK_FITS_(bytes, 20) ? 20 :                 \
+   BTOK_FITS_(bytes, 21) ? 21 :                 \
+   BTOK_FITS_(bytes, 22) ? 22 :                 \
+   BTOK_FITS_(bytes, 23) ? 23 :                 \
+   BTOK_FITS_(bytes, 24) ? 24 :                 \
+   BTOK_FITS_(bytes, 25) ? 25 :                 \
+   BTOK_FITS_(bytes, 26) ? 26 :                 \
+   BTOK_FITS_(bytes, 27) ? 27 :                 \
+   BTOK_FITS_(bytes, 28) ? 28 :                 \
+   BTOK_FITS_(bytes, 29) ? 29 :                 \
+   BTOK_FITS_(bytes, 30) ? 30 :                 \
+   BTOK_FITS_(bytes, 31) ? 31 :                 \
+   BTOK_FITS_(bytes, 32) ? 32 :                 \
+   BTOK_FITS_(bytes, 33) ? 33 :                 \
+   BTOK_FITS_(bytes, 34) ? 34 :                 \
+   BTOK_FITS_(bytes, 35) ? 35 :                 \
+   BTOK_FITS_(bytes, 36) ? 36 :                 \
+   BTOK_FITS_(bytes, 37) ? 37 :                 \
+   BTOK_FITS_(bytes, 38) ? 38 :                 \
+   BTOK_FITS_(bytes, 39) ? 39 :                 \
+   BTOK_FITS_(bytes, 40) ? 40 :                 \
+   BTOK_FITS_(bytes, 41) ? 41 :                 \
+   BTOK_FITS_(bytes, 42) ? 42 :                 \
+   BTOK_FITS_(bytes, 43) ? 43 :                 \
+   BTOK_FITS_(bytes, 44) ? 44 :                 \
+   BTOK_FITS_(bytes, 45) ? 45 :                 \
+   BTOK_FITS_(bytes, 46) ? 46 :                 \
+   BTOK_FITS_(bytes, 47) ? 47 :                 \
+   BTOK_FITS_(bytes, 48) ? 48 :                 \
+   BTOK_FITS_(bytes, 49) ? 49 :                 \
+   BTOK_FITS_(bytes, 50) ? 50 :                 \
+   BTOK_FITS_(bytes, 51) ? 51 :                 \
+   BTOK_FITS_(bytes, 52) ? 52 :                 \
+   BTOK_FITS_(bytes, 53) ? 53 :                 \
+   BTOK_FITS_(bytes, 54) ? 54 :                 \
+   BTOK_FITS_(bytes, 55) ? 55 :                 \
+   BTOK_FITS_(bytes, 56) ? 56 :                 \
+   BTOK_FITS_(bytes, 57) ? 57 :                 \
+   BTOK_FITS_(bytes, 58) ? 58 :                 \
+   BTOK_FITS_(bytes, 59) ? 59 :                 \
+   BTOK_FITS_(bytes, 60) ? 60 :                 \
+   BTOK_FITS_(bytes, 61) ? 61 :                 \
+   BTOK_FITS_(bytes, 62) ? 62 :                 \
+   BTOK_FITS_(bytes, 63) ? 63 :                 \
+   64)
+
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_ALIGNED  2  /*Shim in front of padded aligned memory, leading to the real block*/
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
@@ -44,12 +114,186 @@ extern "C"
    */
   struct avail
   {
-    unsigned short int tag;     /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
-    unsigned short int kval;    /*The kval of this block*/
-    struct avail *next;         /*next memory block*/
+    union
+    {
+      struct
+      {
+        unsigned short int tag; /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
+        unsigned short int kval;/*The kval of this block*/
+      };
+      uint32_t state;           /*tag and kval as one word so they change atomically*/
+    };
+    union
+    {
+      uint32_t canary;          /*Mix of the block offset and kval, set while reserved*/
+      uint32_t zero_from;       /*While free, the block is zero from this offset on, 0 if unknown*/
+    };
+    union
+    {
+      struct avail *next;       /*next memory block*/
+      uint64_t target;          /*Offset of the real block from pool->base (BLOCK_ALIGNED shims)*/
+    };
     struct avail *prev;         /*prev memory block*/
   };
 
+  /**
+   * Block header of BUDDY_COMPACT pools, the same as struct avail up to the
+   * links. Those are offsets from pool->base in units of 2^SMALLEST_K, or
+   * BUDDY_LINK_HEAD for the list head in the pool, so nothing in the arena
+   * depends on the address it is mapped at. The heads in pool->avail use
+   * this layout too in such pools.
+   */
+  struct avail_compact
+  {
+    union
+    {
+      struct
+      {
+        unsigned short int tag; /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
+        unsigned short int kval;/*The kval of this block*/
+      };
+      uint32_t state;           /*tag and kval as one word so they change atomically*/
+    };
+    union
+    {
+      uint32_t canary;          /*Mix of the block offset and kval, set while reserved*/
+      uint32_t zero_from;       /*While free, the block is zero from this offset on, 0 if unknown*/
+    };
+    uint32_t next;              /*Offset of the next memory block*/
+    uint32_t prev;              /*Offset of the prev memory block*/
+  };
+
+#define BUDDY_LINK_HEAD UINT32_MAX /*Link to the avail list head of a BUDDY_COMPACT pool*/
+
+  /**
+   * Largest order of a BUDDY_COMPACT pool, every 2^SMALLEST_K piece of it
+   * has to have a 32 bit offset that is not BUDDY_LINK_HEAD.
+   */
+#define BUDDY_COMPACT_MAX_K 37
+
+  /**
+   * Number of records kept by the allocation trace ring when the library is
+   * built with -DBUDDY_TRACE. Must be a power of two, older records are
+   * overwritten once the ring wraps.
+   */
+#ifndef BUDDY_TRACE_SLOTS
+#define BUDDY_TRACE_SLOTS 4096
+#endif
+
+#define BUDDY_TRACE_MALLOC  1  /*Block handed out by buddy_malloc*/
+#define BUDDY_TRACE_FREE    2  /*Block returned by buddy_free*/
+#define BUDDY_TRACE_FAIL    3  /*buddy_malloc failed with ENOMEM*/
+#define BUDDY_TRACE_REALLOC 4  /*buddy_realloc resized a block in place*/
+
+  /**
+   * Fixed size binary record written to the trace ring. Records are only
+   * produced when the library is compiled with -DBUDDY_TRACE.
+   */
+  struct buddy_trace_rec
+  {
+    uint64_t seq;               /*Sequence number starting at 1, 0 marks an unwritten slot*/
+    uint64_t ns;                /*CLOCK_MONOTONIC time the event was recorded*/
+    uint64_t pool;              /*Address of the pool the event happened in*/
+    uint64_t offset;            /*Block offset from pool->base*/
+    uint64_t size;              /*Bytes requested by the caller, 0 for free*/
+    uint8_t op;                 /*One of the BUDDY_TRACE_* event codes*/
+    uint8_t req_k;              /*Order the request needed, or the order of the freed block*/
+    uint8_t kval;               /*Order the block was taken from or merged up to*/
+    uint8_t pad[5];
+  };
+
+#define BUDDY_CONCURRENT 0x1  /*Lock each avail list so threads can share the pool*/
+#define BUDDY_OOB_META   0x2  /*Keep tag/kval in a side table so blocks have no header*/
+#define BUDDY_BITTREE    0x4  /*Track the buddy tree in bitmaps outside the arena*/
+#define BUDDY_CHECKED    0x8  /*Validate pointers passed to buddy_free and buddy_realloc*/
+#define BUDDY_LAZY       0x10 /*Reserve the arena up front, commit it as blocks are handed out*/
+#define BUDDY_MADV_FREE  0x20 /*Release free memory with MADV_FREE instead of MADV_DONTNEED*/
+#define BUDDY_HUGE_THP   0x40 /*Align the arena for and advise transparent huge pages*/
+#define BUDDY_HUGETLB    0x80 /*Back the arena with explicit hugetlb pages*/
+#define BUDDY_GROW       0x100 /*Map extra arenas when the pool runs out instead of failing*/
+#define BUDDY_SLAB       0x200 /*Pack requests of up to BUDDY_SLAB_MAX bytes into slabs*/
+#define BUDDY_SHARED     0x400 /*Pool lives in a MAP_SHARED region, set by buddy_init_shared*/
+#define BUDDY_COMPACT    0x800 /*16 byte headers linked by 32 bit offsets instead of pointers*/
+#define BUDDY_RESTORED   0x1000 /*Arena is a private mapping of a snapshot, set by buddy_restore*/
+#define BUDDY_FILE       0x2000 /*Arena is a shared mapping of a file, set by buddy_init_file*/
+
+  /**
+   * Alignment of the arena of BUDDY_HUGE_THP pools, the transparent huge
+   * page size on x86-64 and arm64 with 4KiB pages.
+   */
+#define BUDDY_THP_K 21
+
+  /**
+   * Lazily committed pools (BUDDY_LAZY) make their arena accessible in
+   * chunks of 2^BUDDY_COMMIT_K bytes, or the whole pool if it is smaller.
+   * Larger chunks mean fewer mprotect calls and mappings, smaller ones
+   * commit less memory for sparse pools.
+   */
+#ifndef BUDDY_COMMIT_K
+#define BUDDY_COMMIT_K 21
+#endif
+
+  /**
+   * File backed pools (buddy_init_file) punch freed blocks of this order and
+   * up out of their file unless opts->release_k asks for another order.
+   */
+#define BUDDY_FILE_RELEASE_K 21
+
+  /**
+   * BUDDY_SLAB pools cut blocks of 2^BUDDY_SLAB_K bytes into equal slots for
+   * requests of 8, 16, 32 and 48 bytes, the BUDDY_SLAB_CLASSES size classes
+   * up to BUDDY_SLAB_MAX.
+   */
+#ifndef BUDDY_SLAB_K
+#define BUDDY_SLAB_K 12
+#endif
+#define BUDDY_SLAB_CLASSES 4
+#define BUDDY_SLAB_MAX 48
+
+#define BUDDY_ERR_RANGE  1  /*Pointer does not lie inside the pool*/
+#define BUDDY_ERR_ALIGN  2  /*Pointer is not the start of a block*/
+#define BUDDY_ERR_FREED  3  /*Block is already free, a double free*/
+#define BUDDY_ERR_CANARY 4  /*Block header has been overwritten*/
+
+  struct buddy_pool;
+
+  /**
+   * Called by a BUDDY_CHECKED pool when it rejects a pointer. The bad pointer
+   * is left alone, buddy_free returns without freeing anything and
+   * buddy_realloc returns NULL with errno set to EINVAL.
+   *
+   * @param pool The pool the pointer was passed to
+   * @param ptr The rejected pointer
+   * @param err One of the BUDDY_ERR_* codes
+   */
+  typedef void (*buddy_error_fn)(struct buddy_pool *pool, void *ptr, int err);
+
+  /**
+   * Number of small orders, starting at SMALLEST_K, that are served from per
+   * thread magazines when a pool is created with a magazine_depth.
+   */
+#define BUDDY_MAG_ORDERS 5
+
+  /**
+   * Largest magazine_depth buddy_init_opts accepts.
+   */
+#define BUDDY_MAG_MAX_DEPTH 256
+
+  /**
+   * Options for buddy_init_opts. A zeroed struct gives the same pool as buddy_init.
+   */
+  struct buddy_options
+  {
+    unsigned int flags;         /*Bitwise OR of BUDDY_* pool flags*/
+    unsigned int magazine_depth;/*Blocks each thread caches per small order, 0 disables*/
+    buddy_error_fn on_error;    /*Error callback for BUDDY_CHECKED, NULL prints and aborts*/
+    unsigned int release_k;     /*Free blocks of this order and up go back to the OS, 0 never*/
+    unsigned int huge_k;        /*Huge page order for BUDDY_HUGETLB (21 or 30), 0 means 21*/
+  };
+
+  struct bittree;
+  struct slab;
+
   /**
    * The buddy memory pool.
    */
@@ -58,11 +302,57 @@ extern "C"
     size_t kval_m;              /*The max kval of this pool*/
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
+    uint64_t avail_mask;        /*Bit k is set when avail[k] has at least one free block*/
+    unsigned int flags;         /*BUDDY_* flags the pool was created with*/
+    int busy;                   /*Blocks off avail mid split or merge (BUDDY_CONCURRENT only)*/
+    int lock[MAX_K];            /*Spin lock for each avail list (BUDDY_CONCURRENT only)*/
+    unsigned int mag_depth;     /*Per thread magazine depth, 0 when magazines are off*/
+    pthread_key_t mag_key;      /*Key holding each thread's magazine for this pool*/
+    unsigned char *meta;        /*Tag/kval side table, one byte per 2^SMALLEST_K (BUDDY_OOB_META only)*/
+    struct bittree *bt;         /*Free and split bitmaps (BUDDY_BITTREE only)*/
+    buddy_error_fn on_error;    /*Where rejected pointers are reported (BUDDY_CHECKED only)*/
+    uint64_t *commit_map;       /*Bit per committed chunk of the arena (BUDDY_LAZY only)*/
+    size_t committed;           /*Bytes of the arena that are readable and writable*/
+    size_t release_k;           /*Order from which freed blocks are returned to the OS, 0 never*/
+    size_t huge_k;              /*Order of the hugetlb pages backing the arena, 0 for normal pages*/
+    size_t nfree[MAX_K];        /*Number of free blocks of each order*/
+    uint64_t allocs;            /*Blocks handed out since init*/
+    uint64_t splits;            /*Blocks split in two since init*/
+    uint64_t merges;            /*Buddy pairs joined since init*/
+    uint64_t failures;          /*Requests that failed with ENOMEM since init*/
+    uint64_t waste;             /*Bytes handed out beyond what was asked for since init*/
+    uint64_t released;          /*Bytes handed back to the OS since init*/
+    struct buddy_pool *next_arena;/*First grown arena, or the next one in an arena (BUDDY_GROW only)*/
+    size_t narenas;             /*Number of grown arenas mapped (BUDDY_GROW only)*/
+    pthread_rwlock_t arena_lock;/*Guards the arena list (BUDDY_GROW and BUDDY_CONCURRENT only)*/
+    uint64_t *slab_map;         /*Bit per 2^BUDDY_SLAB_K of arena, set while it is a slab (BUDDY_SLAB only)*/
+    struct slab *slabs[BUDDY_SLAB_CLASSES];/*Slabs with a free slot for each class (BUDDY_SLAB only)*/
+    int slab_lock[BUDDY_SLAB_CLASSES];/*Spin lock for each class's slabs (BUDDY_CONCURRENT only)*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
   };
 
   /**
-   * Converts bytes to its equivalent K value defined as bytes <= 2^K
+   * Snapshot of a pool's usage filled in by buddy_stats.
+   */
+  struct buddy_stats
+  {
+    size_t allocated;           /*Bytes in reserved blocks, headers and magazines included*/
+    size_t free;                /*Bytes in free blocks*/
+    size_t largest_free;        /*Size of the largest free block, 0 when the pool is full*/
+    size_t committed;           /*Bytes of the arena committed, all of it unless BUDDY_LAZY*/
+    size_t free_blocks[MAX_K];  /*Number of free blocks of each order*/
+    uint64_t allocs;            /*Blocks handed out since init*/
+    uint64_t splits;            /*Blocks split in two since init*/
+    uint64_t merges;            /*Buddy pairs joined since init*/
+    uint64_t failures;          /*Requests that failed with ENOMEM since init*/
+    uint64_t internal_frag;     /*Bytes handed out beyond what was asked for since init*/
+    uint64_t released;          /*Bytes handed back to the OS with madvise since init*/
+    size_t arenas;              /*Grown arenas currently mapped (BUDDY_GROW only)*/
+  };
+
+  /**
+   * Converts bytes to its equivalent K value defined as bytes <= 2^K.
+   * Runs in constant time, requests smaller than 2^SMALLEST_K return SMALLEST_K.
    * @param bytes The bytes needed
    * @return K The number of bytes expressed as 2^K
    */
@@ -91,13 +381,35 @@ extern "C"
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Allocates an array of n elements of size bytes each, all set to zero.
+   * n * size overflowing counts as too large.
+   *
+   * Free blocks in list based pools remember how much of them is known to
+   * be zero, because they came fresh from mmap or were handed back to the OS
+   * with MADV_DONTNEED (see release_k and buddy_trim). Only the rest is
+   * cleared, so a large table from a new pool costs no pass over memory.
+   * Blocks small enough for the magazines and all BUDDY_BITTREE blocks are
+   * simply cleared.
+   *
+   * If n or size is zero, or pool is NULL, the return value will be NULL.
+   * If the memory can not be found errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param n The number of elements
+   * @param size The size of each element in bytes
+   * @return A pointer to the zeroed memory block
+   */
+  void *buddy_calloc(struct buddy_pool *pool, size_t n, size_t size);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
    * for further allocations.
    *
    * If ptr does not point to a block of memory allocated with
-   * the above functions, it causes undefined behavior.
+   * the above functions, it causes undefined behavior, unless the pool was
+   * created with BUDDY_CHECKED in which case it is reported and ignored.
    *
    * If ptr is a null pointer, the function does nothing.
    * Notice that this function does not change the value of ptr itself,
@@ -108,6 +420,80 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Allocates size bytes whose address is a multiple of alignment, which must
+   * be a power of two. The memory is released with buddy_free as usual.
+   *
+   * A block of order k always starts a multiple of 2^k bytes past the pool
+   * base, and the base is at least page aligned (2MiB for BUDDY_HUGE_THP and
+   * BUDDY_HUGETLB pools). Pools without block headers (BUDDY_OOB_META and
+   * BUDDY_BITTREE) therefore just pick an order of at least the alignment and
+   * waste nothing beyond the usual power of two rounding, but can not serve
+   * an alignment larger than the base alignment. Header pools pad the front
+   * of the block up to the alignment, leaving a small shim in front of the
+   * user pointer that leads buddy_free back to the real header. That costs
+   * the alignment less the header over a plain request, so page aligned
+   * memory is much cheaper from the header free pools.
+   *
+   * buddy_realloc does not keep the alignment when it has to move the data.
+   *
+   * If size is zero or pool is NULL the return value will be NULL. A bad
+   * alignment fails with errno set to EINVAL, lack of memory with ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param alignment The alignment in bytes, a power of two
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block
+   */
+  void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size);
+
+  /**
+   * Number of bytes the caller may use at ptr, which is everything up to the
+   * end of its buddy block: 2^k less the header, or less the padding for
+   * buddy_aligned_alloc memory. This is at least the size that was asked
+   * for, and buddy_realloc to any size up to it returns ptr unchanged, so
+   * growable buffers can use the slack before asking for more.
+   *
+   * If ptr or pool is NULL the return value is 0. Checked pools report a
+   * bad pointer and return 0.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to a memory block in use
+   * @return The usable size of the block in bytes
+   */
+  size_t buddy_usable_size(struct buddy_pool *pool, void *ptr);
+
+  /**
+   * Allocates n blocks of size bytes each. Rather than splitting once per
+   * block, the largest available block that the remaining count can use is
+   * split down once and cut into siblings, so the avail lists are touched
+   * a handful of times instead of n.
+   *
+   * If fewer than n blocks fit, the ones that did are still returned and
+   * errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of each block in bytes
+   * @param n The number of blocks wanted
+   * @param out Array of at least n entries receiving the blocks
+   * @return The number of blocks stored in out
+   */
+  size_t buddy_malloc_bulk(struct buddy_pool *pool, size_t size, size_t n, void *out[]);
+
+  /**
+   * Frees n blocks at once. The pointers are sorted by address so buddies
+   * that are both being freed are joined in a single pass before anything is
+   * put back on the avail lists. NULL entries are skipped.
+   *
+   * Note that ptrs is sorted in place, and entries freed into the grown
+   * arenas of a BUDDY_GROW pool are set to NULL.
+   *
+   * @param pool The memory pool
+   * @param ptrs The blocks to free
+   * @param n The number of entries in ptrs
+   */
+  void buddy_free_bulk(struct buddy_pool *pool, void *ptrs[], size_t n);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -124,6 +510,12 @@ extern "C"
    * if size is equal to zero, and ptr is not NULL, then the  call
    * is equivalent to free(ptr)
    *
+   * Shrinking always happens in place by returning the unused upper halves
+   * to the pool. Growing happens in place when the buddies above the block
+   * are free, otherwise the data is copied to a new block. If no block is
+   * large enough NULL is returned, errno is set to ENOMEM and ptr is left
+   * untouched.
+   *
    * @param pool The memory pool
    * @param ptr Pointer to a memory block
    * @param size The new size of the memory block
@@ -152,9 +544,274 @@ extern "C"
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_init but with extra options, and failures are reported to
+   * the caller instead of killing the process.
+   *
+   * With BUDDY_CONCURRENT set in opts->flags the pool may be used from many
+   * threads at once without outside locking. Every avail list gets its own
+   * lock and splits and merges only ever hold one of them at a time, except
+   * buddy_realloc which takes the orders it grows through in ascending order.
+   *
+   * With BUDDY_OOB_META the tag and kval of every block are kept in a side
+   * table outside the arena instead of a struct avail in front of the user
+   * memory, so a request of exactly 2^k bytes fits a 2^k block and pointers
+   * are 2^k aligned relative to the pool base. Free blocks still thread the
+   * avail lists through their own memory. The table costs one byte per
+   * 2^SMALLEST_K bytes of pool.
+   *
+   * BUDDY_BITTREE selects a second backend that keeps no metadata in the
+   * arena at all. For every order there is a bitmap of which blocks are free
+   * (standing in for the avail lists) and a bitmap of which blocks have been
+   * split, so the order of a block being freed is found by following split
+   * bits down from the root. Blocks have no header, like BUDDY_OOB_META which
+   * it can not be combined with, and the arena is only touched by the caller.
+   * The maps cost about three bits per 2^SMALLEST_K bytes of pool.
+   *
+   * BUDDY_CHECKED makes buddy_free, buddy_free_bulk and buddy_realloc reject
+   * pointers that are outside the pool, not aligned to the order of their
+   * block, already free, or whose header canary no longer matches, and report
+   * them to opts->on_error. The checks read the block's own header or side
+   * table entry and nothing else, so they are cheap enough to leave on. A
+   * block freed twice is only caught until its memory is handed out again,
+   * and bittree pools can not catch a double free into a thread's magazine.
+   *
+   * BUDDY_LAZY reserves the arena with PROT_NONE and MAP_NORESERVE, so
+   * creating a pool costs no commit charge and almost no time. Chunks of
+   * 2^BUDDY_COMMIT_K bytes are made writable the first time a block in them
+   * is handed out or has a free list header written into it, and stay
+   * committed after that. If the kernel refuses to commit more the
+   * allocation fails with ENOMEM like any other.
+   *
+   * With a non-zero opts->release_k, whenever a free leaves a block of that
+   * order or larger on the avail lists its pages are handed back to the OS
+   * with MADV_DONTNEED, or MADV_FREE with BUDDY_MADV_FREE, so RSS drops back
+   * after a peak. Pools that keep free list links in the arena keep the
+   * first page of each block. release_k must cover at least a page.
+   *
+   * BUDDY_HUGETLB maps the arena with MAP_HUGETLB using pages of
+   * 2^opts->huge_k bytes, which needs a pool at least that large and huge
+   * pages reserved by the administrator. When that fails the pool falls back
+   * to BUDDY_HUGE_THP, which aligns the arena to 2^BUDDY_THP_K and advises
+   * MADV_HUGEPAGE so transparent huge pages can back it, and if THP is not
+   * available either the pool uses normal pages. pool->flags is updated to
+   * what the pool actually got. Hugetlb pages are always reserved when the
+   * pool is created, BUDDY_LAZY only defers making them accessible.
+   *
+   * BUDDY_GROW makes the pool map another arena when a request does not fit,
+   * instead of failing with ENOMEM. Each arena is a pool of its own with the
+   * same options, at least as large as this one and large enough for the
+   * request, except that it has no magazines. Pointers from any arena may be
+   * passed to the functions taking this pool, a pointer outside the first
+   * arena is looked up in the others. When a free leaves a grown arena empty
+   * it is kept as a spare, and unmapped only once a second one is empty too,
+   * so a pool hovering around an arena boundary does not map and unmap on
+   * every request. buddy_trim unmaps all empty grown arenas.
+   *
+   * BUDDY_SLAB serves requests of up to BUDDY_SLAB_MAX bytes from slabs,
+   * blocks of 2^BUDDY_SLAB_K bytes cut into slots of one size class with a
+   * free bitmap in front and no header per object, so an 8 byte object takes
+   * 8 bytes instead of a 64 byte block. A map outside the arena with one bit
+   * per slab sized piece of the pool tells buddy_free which pointers are
+   * slots. The last empty slab of each class is kept for the next request,
+   * buddy_trim gives those back too, as does a free that leaves a grown
+   * arena with nothing else in it. Slots are 8 byte aligned, 16 for the
+   * larger classes, and small requests take slabs over magazines. When no
+   * block is left to cut a slab from, they get a block of their own.
+   *
+   * BUDDY_COMPACT lays blocks out as struct avail_compact, whose free list
+   * links are 32 bit offsets from the pool base instead of pointers. The
+   * header shrinks from 24 to 16 bytes, so requests of 41 to 48 bytes fit a
+   * 2^SMALLEST_K block and every order holds 8 bytes more, at the price of
+   * turning offsets into addresses while walking the lists. The arena then
+   * holds no pointers at all, so an image of it and pool->avail stays valid
+   * when it is mapped somewhere else and pool->base is moved along (slabs
+   * excepted, they still point at each other). The pool can be at most
+   * 2^BUDDY_COMPACT_MAX_K bytes, and BUDDY_BITTREE, which has no free list
+   * in the arena, can not be combined with it.
+   *
+   * With a non-zero opts->magazine_depth every thread keeps up to that many
+   * already split blocks for each of the BUDDY_MAG_ORDERS smallest orders.
+   * Small requests are served from and freed to the magazine without touching
+   * the avail lists, and magazines are refilled and flushed half a depth at a
+   * time. Cached blocks stay reserved so they can not merge until they are
+   * flushed by buddy_magazine_flush or the thread exiting.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes.
+   * @param opts Pool options, NULL for the defaults
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_options *opts);
+
+  /**
+   * Same as buddy_init_opts, but the arena is a shared mapping of the file at
+   * path instead of anonymous memory, so pools can be far larger than RAM
+   * plus swap with the page cache deciding what stays in memory. The file is
+   * created, or truncated if it exists, and made as large as the pool but
+   * sparse, so it only takes disk space where the arena has been written.
+   * It may be unlinked as soon as this returns, the mapping keeps it alive.
+   *
+   * Freed blocks of release_k and up are punched out of the file with
+   * MADV_REMOVE, so disk use follows what is allocated, and read back as
+   * zero. A release_k of 0 means BUDDY_FILE_RELEASE_K here. buddy_trim
+   * punches out every free block of a page or more, and buddy_destroy the
+   * whole file. On file systems without hole punching the space stays in
+   * use until the file is removed.
+   *
+   * BUDDY_MADV_FREE, BUDDY_HUGE_THP, BUDDY_HUGETLB and BUDDY_GROW only make
+   * sense for anonymous memory and fail with EINVAL. Side tables and bitmaps
+   * of BUDDY_OOB_META, BUDDY_BITTREE and BUDDY_SLAB pools are still kept in
+   * memory. pool->flags gets BUDDY_FILE.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param path The file to back the arena with
+   * @param size The size of the pool in bytes
+   * @param opts Pool options, NULL for the defaults
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_init_file(struct buddy_pool *pool, const char *path, size_t size,
+                      const struct buddy_options *opts);
+
+  /**
+   * Create a pool that several processes can use at once. The pool header
+   * and the arena share one MAP_SHARED region, and every process maps it at
+   * the same address, so the free list links inside it and the pointers
+   * buddy_malloc returns are valid in all of them. A buffer allocated by one
+   * process can be handed to another as a plain pointer and freed there.
+   *
+   * With a name the region is a POSIX shared memory object (see shm_open)
+   * that other processes attach to with buddy_open_shared, and creating it
+   * fails with EEXIST if the name is taken. Without one the region is
+   * anonymous and only shared with children forked after this call, which
+   * simply keep using the returned pool.
+   *
+   * Shared pools are always BUDDY_CONCURRENT, their locks are plain atomics
+   * in the region and work across processes. A process that dies holding
+   * one leaves the pool locked. Only BUDDY_CHECKED, BUDDY_COMPACT and
+   * release_k may be given in opts, the other features keep per process
+   * state outside the region, and bad pointers are always printed followed
+   * by an abort since no on_error function is valid in every process. Released pages are removed
+   * from the shared memory object with MADV_REMOVE.
+   *
+   * @param name The shm_open name of the region, NULL for an anonymous one
+   * @param size The size of the pool in bytes, rounded like buddy_init
+   * @param opts Pool options, NULL for the defaults
+   * @return The pool, or NULL with errno set on failure
+   */
+  struct buddy_pool *buddy_init_shared(const char *name, size_t size, const struct buddy_options *opts);
+
+  /**
+   * Attach to a pool another process created with buddy_init_shared. The
+   * region is mapped at the creator's address, if this process already has
+   * something there the call fails with EEXIST. EAGAIN means the creator
+   * has not finished setting the pool up yet.
+   *
+   * @param name The name the pool was created with
+   * @return The pool, or NULL with errno set on failure
+   */
+  struct buddy_pool *buddy_open_shared(const char *name);
+
+  /**
+   * Unmap a shared pool from the calling process. The pool and everything
+   * allocated from it stay intact for the other processes using it. Does
+   * nothing for pools that are not shared.
+   *
+   * @param pool The shared pool
+   */
+  void buddy_close_shared(struct buddy_pool *pool);
+
+  /**
+   * Return every block the calling thread has cached in its magazine for pool,
+   * and the magazine itself, back to the pool. Does nothing for pools
+   * without magazines.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_magazine_flush(struct buddy_pool *pool);
+
+  /**
+   * Hand the pages of every free block of at least a page back to the OS,
+   * whatever the pool's release_k. Each order is locked while its blocks
+   * are released so concurrent pools stall briefly. Empty grown arenas of
+   * BUDDY_GROW pools are unmapped and count as released.
+   *
+   * @param pool The memory pool
+   * @return The number of bytes released
+   */
+  size_t buddy_trim(struct buddy_pool *pool);
+
+  /**
+   * Write the pool to the file at path, so buddy_restore can bring it back
+   * with everything that is allocated in it, for instance after a restart.
+   * The file holds the pool's bookkeeping, the reserved memory of the arena
+   * and the side table or bittree maps. Free memory is left out as holes, so
+   * the file is about as large as what is in use. An existing file is
+   * replaced.
+   *
+   * Nothing may use the pool while it is written. The calling thread's
+   * magazine is flushed first, blocks in other threads' magazines are
+   * written as allocated. BUDDY_GROW, BUDDY_SLAB and shared pools can not be
+   * written and fail with EINVAL.
+   *
+   * @param pool The memory pool
+   * @param path The file to write
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_snapshot(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Initialize pool from a file written by buddy_snapshot. The arena is a
+   * private mapping of the file, so this costs a few system calls and the
+   * data is paged in as it is touched, while changes to the pool never
+   * reach the file. Pointers into the old pool are valid in the new one at
+   * the same offset from pool->base.
+   *
+   * Pools linked by pointers are mapped at their old address when it is
+   * free, which leaves only the ends of each avail list to fix up. Anywhere
+   * else every free block's links are rewritten. BUDDY_COMPACT and
+   * BUDDY_BITTREE pools have nothing in the arena to fix and are mapped
+   * wherever the kernel likes.
+   *
+   * The pool keeps its flags, release_k and statistics, and has
+   * BUDDY_RESTORED added. It has no magazines and no on_error callback,
+   * which can be set in pool->on_error. The arena is made of normal pages
+   * and committed as a whole, so BUDDY_LAZY, BUDDY_HUGE_THP and
+   * BUDDY_HUGETLB are dropped. Memory released to the OS reads back as it
+   * was in the file rather than zero. The pool is freed with buddy_destroy
+   * as usual.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param path The file buddy_snapshot wrote
+   * @return 0 on success, -1 with errno set on failure, EINVAL if path is
+   * not a snapshot written by this version of the library
+   */
+  int buddy_restore(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Fill out with the pool's current usage. The counters are kept up to date
+   * by every allocation and free so this only costs a pass over the orders.
+   *
+   * Blocks cached in per thread magazines count as allocated, and blocks
+   * handed out from a magazine were already counted when it was refilled.
+   * On a concurrent pool other threads keep running while the snapshot is
+   * taken, so blocks in the middle of a split or merge show up as allocated.
+   *
+   * BUDDY_GROW pools add up all of their arenas. A request the first arena
+   * turned away counts as a failure there even when a grown arena served it.
+   *
+   * @param pool The memory pool
+   * @param out Where to store the statistics
+   */
+  void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
   /**
    * Inverse of buddy_init.
    *
+   * For a shared pool this removes its name so no new process can open it
+   * and unmaps it like buddy_close_shared. Processes that already have it
+   * mapped carry on until they close it.
+   *
    * Notice that this function does not change the value of pool itself,
    * hence it still points to the same (now invalid) location.
    *
@@ -162,6 +819,25 @@ extern "C"
    */
   void buddy_destroy(struct buddy_pool *pool);
 
+  /**
+   * Copy the records currently held in the trace ring, oldest first. Records
+   * being overwritten while the copy runs are skipped, so this is safe to call
+   * while other threads allocate. Always returns 0 when the library was built
+   * without -DBUDDY_TRACE.
+   *
+   * @param out Array to copy the records into
+   * @param max The number of records out can hold
+   * @return The number of records copied
+   */
+  size_t buddy_trace_snapshot(struct buddy_trace_rec *out, size_t max);
+
+  /**
+   * Decode the trace ring into one human readable line per record.
+   *
+   * @param out The stream to write to
+   */
+  void buddy_trace_dump(FILE *out);
+
   /**
    * @brief Entry to a main function for testing purposes
    *
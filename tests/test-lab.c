@@ -1,6 +1,12 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -20,11 +26,40 @@ void tearDown(void) {
 
 
 
+/**
+ * check_buddy_pool_full for BUDDY_COMPACT pools, whose lists are linked by
+ * offsets from the base.
+ */
+static void check_buddy_pool_full_compact(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i < pool->kval_m; i++)
+    {
+      struct avail_compact *head = (struct avail_compact *)&pool->avail[i];
+      assert(head->next == BUDDY_LINK_HEAD);
+      assert(head->prev == BUDDY_LINK_HEAD);
+      assert(head->tag == BLOCK_UNUSED);
+      assert(head->kval == i);
+    }
+
+  //The base block, at offset 0, is the only one on the top list
+  struct avail_compact *head = (struct avail_compact *)&pool->avail[pool->kval_m];
+  struct avail_compact *block = pool->base;
+  assert(head->next == 0 && head->prev == 0);
+  assert(block->tag == BLOCK_AVAIL);
+  assert(block->next == BUDDY_LINK_HEAD && block->prev == BUDDY_LINK_HEAD);
+  assert(pool->avail_mask == (UINT64_C(1) << pool->kval_m));
+}
+
 /**
  * Check the pool to ensure it is full.
  */
 void check_buddy_pool_full(struct buddy_pool *pool)
 {
+  if (pool->flags & BUDDY_COMPACT) {
+    check_buddy_pool_full_compact(pool);
+    return;
+  }
+
   //A full pool should have all values 0-(kval-1) as empty
   for (size_t i = 0; i < pool->kval_m; i++)
     {
@@ -43,6 +78,9 @@ void check_buddy_pool_full(struct buddy_pool *pool)
   //If this fails either buddy_init is wrong or we have corrupted the
   //buddy_pool struct.
   assert(pool->avail[pool->kval_m].next == pool->base);
+
+  //Only the top order should be marked as having free blocks
+  assert(pool->avail_mask == (UINT64_C(1) << pool->kval_m));
 }
 
 /**
@@ -76,6 +114,47 @@ void check_buddy_pool_empty(struct buddy_pool *pool)
       assert(pool->avail[i].tag == BLOCK_UNUSED);
       assert(pool->avail[i].kval == i);
     }
+  assert(pool->avail_mask == 0);
+}
+
+/**
+ * Check that every bit in avail_mask agrees with whether the matching
+ * avail list actually has blocks on it.
+ */
+void check_buddy_pool_mask(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i <= pool->kval_m; i++)
+    {
+      bool has_blocks = pool->avail[i].next != &pool->avail[i];
+      bool marked = (pool->avail_mask >> i) & 1;
+      TEST_ASSERT_EQUAL(has_blocks, marked);
+    }
+}
+
+/**
+ * Check a pool that has no avail lists (BUDDY_BITTREE) is back to one free
+ * block by asking for all of it.
+ */
+void check_buddy_pool_whole(struct buddy_pool *pool)
+{
+  TEST_ASSERT_EQUAL_UINT64(UINT64_C(1) << pool->kval_m, pool->avail_mask);
+  void *all = buddy_malloc(pool, pool->numbytes);
+  TEST_ASSERT_EQUAL_PTR(pool->base, all);
+  TEST_ASSERT_EQUAL_UINT64(0, pool->avail_mask);
+  buddy_free(pool, all);
+  TEST_ASSERT_EQUAL_UINT64(UINT64_C(1) << pool->kval_m, pool->avail_mask);
+}
+
+/**
+ * Check a pool is back to one free block, whichever backend it uses.
+ */
+void check_buddy_pool_free(struct buddy_pool *pool)
+{
+  if (pool->flags & BUDDY_BITTREE) {
+    check_buddy_pool_whole(pool);
+  } else {
+    check_buddy_pool_full(pool);
+  }
 }
 
 /**
@@ -176,6 +255,33 @@ void test_btok_boundaries(void) {
   assert(k3 == 7); 
 }
 
+//BTOK_CONST must be usable where only constant expressions are allowed
+_Static_assert(BTOK_CONST(1) == SMALLEST_K, "BTOK_CONST clamps to SMALLEST_K");
+_Static_assert(BTOK_CONST(UINT64_C(1) << DEFAULT_K) == DEFAULT_K, "BTOK_CONST exact power");
+static const size_t btok_const_table[] = { BTOK_CONST(24), BTOK_CONST(100), BTOK_CONST(4097) };
+
+void test_btok_every_order(void) {
+  fprintf(stderr, "-> Testing btok at every order boundary\n");
+
+  TEST_ASSERT_EQUAL_size_t(SMALLEST_K, btok(0));
+  TEST_ASSERT_EQUAL_size_t(SMALLEST_K, btok(1));
+  TEST_ASSERT_EQUAL_size_t(6, btok_const_table[0]);
+  TEST_ASSERT_EQUAL_size_t(7, btok_const_table[1]);
+  TEST_ASSERT_EQUAL_size_t(13, btok_const_table[2]);
+
+  for (size_t k = SMALLEST_K; k < MAX_K; k++) {
+    size_t exact = UINT64_C(1) << k;
+
+    TEST_ASSERT_EQUAL_size_t(k, btok(exact - 1));
+    TEST_ASSERT_EQUAL_size_t(k, btok(exact));
+    TEST_ASSERT_EQUAL_size_t(k + 1, btok(exact + 1));
+
+    TEST_ASSERT_EQUAL_size_t(btok(exact - 1), BTOK_CONST(exact - 1));
+    TEST_ASSERT_EQUAL_size_t(btok(exact), BTOK_CONST(exact));
+    TEST_ASSERT_EQUAL_size_t(btok(exact + 1), BTOK_CONST(exact + 1));
+  }
+}
+
 void test_buddy_calc(void) {
   fprintf(stderr, "-> Testing buddy_calc correctness\n");
 
@@ -311,6 +417,1718 @@ void test_malloc_mixed_sizes(void) {
   free(sizes);
 }
 
+/**
+ * Allocate and free a random mix of sizes and make sure avail_mask tracks
+ * the avail lists through every split and merge.
+ */
+void test_avail_mask_tracks_lists(void) {
+  fprintf(stderr, "-> Testing avail_mask bookkeeping\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  check_buddy_pool_mask(&pool);
+
+  void *ptrs[64];
+  for (size_t i = 0; i < 64; i++) {
+    ptrs[i] = buddy_malloc(&pool, (size_t)(rand() % 2000) + 1);
+    TEST_ASSERT_NOT_NULL(ptrs[i]);
+    check_buddy_pool_mask(&pool);
+  }
+
+  // Free every other block first so merges happen out of order
+  for (size_t i = 0; i < 64; i += 2) {
+    buddy_free(&pool, ptrs[i]);
+    check_buddy_pool_mask(&pool);
+  }
+  for (size_t i = 1; i < 64; i += 2) {
+    buddy_free(&pool, ptrs[i]);
+    check_buddy_pool_mask(&pool);
+  }
+
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * With -DBUDDY_TRACE every malloc and free should leave a decodable record in
+ * the ring, without it the ring must be compiled out and always empty.
+ */
+void test_trace_ring(void) {
+  fprintf(stderr, "-> Testing allocation trace ring\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  void *mem = buddy_malloc(&pool, 100);
+  TEST_ASSERT_NOT_NULL(mem);
+  buddy_free(&pool, mem);
+
+  struct buddy_trace_rec *recs = malloc(sizeof(struct buddy_trace_rec) * BUDDY_TRACE_SLOTS);
+  TEST_ASSERT_NOT_NULL(recs);
+  size_t n = buddy_trace_snapshot(recs, BUDDY_TRACE_SLOTS);
+#ifdef BUDDY_TRACE
+  TEST_ASSERT(n >= 2);
+  struct buddy_trace_rec *m = &recs[n - 2];
+  struct buddy_trace_rec *f = &recs[n - 1];
+  TEST_ASSERT_EQUAL_UINT8(BUDDY_TRACE_MALLOC, m->op);
+  TEST_ASSERT_EQUAL_UINT64(100, m->size);
+  TEST_ASSERT_EQUAL_UINT8(btok(100 + sizeof(struct avail)), m->req_k);
+  TEST_ASSERT_EQUAL_UINT8(MIN_K, m->kval);
+  TEST_ASSERT_EQUAL_UINT8(BUDDY_TRACE_FREE, f->op);
+  TEST_ASSERT_EQUAL_UINT8(MIN_K, f->kval);
+  TEST_ASSERT_EQUAL_UINT64(m->seq + 1, f->seq);
+  TEST_ASSERT_EQUAL_UINT64((uintptr_t)&pool, f->pool);
+  buddy_trace_dump(stderr);
+#else
+  TEST_ASSERT_EQUAL_size_t(0, n);
+#endif
+  free(recs);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Shrinking returns the tail halves to the pool and growing absorbs free
+ * buddies, both without moving the data.
+ */
+void test_realloc_in_place(void) {
+  fprintf(stderr, "-> Testing buddy_realloc in place\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  //NULL behaves like malloc
+  char *mem = buddy_realloc(&pool, NULL, 1000);
+  TEST_ASSERT_NOT_NULL(mem);
+  struct avail *header = (struct avail *)mem - 1;
+  TEST_ASSERT_EQUAL_UINT16(10, header->kval);
+  memset(mem, 0xAB, 1000);
+
+  //Shrink to a 64 byte block, orders 6-9 get the released halves
+  char *small = buddy_realloc(&pool, mem, 10);
+  TEST_ASSERT_EQUAL_PTR(mem, small);
+  TEST_ASSERT_EQUAL_UINT16(SMALLEST_K, header->kval);
+  for (size_t k = SMALLEST_K; k < 10; k++) {
+    TEST_ASSERT(pool.avail[k].next != &pool.avail[k]);
+  }
+  check_buddy_pool_mask(&pool);
+
+  //Grow back up past the original size, every buddy above is free
+  char *big = buddy_realloc(&pool, small, 5000);
+  TEST_ASSERT_EQUAL_PTR(mem, big);
+  TEST_ASSERT_EQUAL_UINT16(13, header->kval);
+  for (size_t i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0xAB, (unsigned char)big[i]);
+  }
+  check_buddy_pool_mask(&pool);
+
+  //realloc to 0 frees the block
+  TEST_ASSERT_NULL(buddy_realloc(&pool, big, 0));
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * When the buddy is in use the block has to move and the contents must come
+ * along. A failed grow must leave the original block intact.
+ */
+void test_realloc_moves_when_buddy_busy(void) {
+  fprintf(stderr, "-> Testing buddy_realloc copy fallback\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  char *a = buddy_malloc(&pool, 40);
+  char *b = buddy_malloc(&pool, 40);
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_NOT_NULL(b);
+  for (int i = 0; i < 40; i++) {
+    a[i] = (char)i;
+  }
+
+  char *grown = buddy_realloc(&pool, a, 300);
+  TEST_ASSERT_NOT_NULL(grown);
+  TEST_ASSERT(grown != a);
+  for (int i = 0; i < 40; i++) {
+    TEST_ASSERT_EQUAL_INT8((char)i, grown[i]);
+  }
+
+  //Asking for more than the pool holds fails without freeing anything
+  errno = 0;
+  TEST_ASSERT_NULL(buddy_realloc(&pool, grown, UINT64_C(1) << MIN_K));
+  TEST_ASSERT_EQUAL_INT(ENOMEM, errno);
+  TEST_ASSERT_EQUAL_UINT16(BLOCK_RESERVED, ((struct avail *)grown - 1)->tag);
+
+  buddy_free(&pool, grown);
+  buddy_free(&pool, b);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+#define STRESS_THREADS 8
+#define STRESS_SLOTS   64
+#define STRESS_ROUNDS  20000
+
+struct stress_arg
+{
+  struct buddy_pool *pool;
+  unsigned seed;
+  int id;
+  int failures;
+  size_t max_size;  /*Largest request, 0 for 3000 bytes*/
+};
+
+/**
+ * Randomly allocate and free from a shared pool. Every block is filled with a
+ * byte derived from the thread and slot and checked before it is freed, so two
+ * threads getting overlapping blocks shows up as a failure.
+ */
+static void *stress_worker(void *p)
+{
+  struct stress_arg *arg = p;
+  unsigned char *slots[STRESS_SLOTS] = {0};
+  size_t sizes[STRESS_SLOTS] = {0};
+
+  for (int round = 0; round < STRESS_ROUNDS; round++) {
+    int i = rand_r(&arg->seed) % STRESS_SLOTS;
+    if (slots[i]) {
+      for (size_t b = 0; b < sizes[i]; b++) {
+        if (slots[i][b] != (unsigned char)(arg->id * STRESS_SLOTS + i)) {
+          arg->failures++;
+          break;
+        }
+      }
+      buddy_free(arg->pool, slots[i]);
+      slots[i] = NULL;
+    } else {
+      sizes[i] = (size_t)(rand_r(&arg->seed) % (arg->max_size ? arg->max_size : 3000)) + 1;
+      slots[i] = buddy_malloc(arg->pool, sizes[i]);
+      if (slots[i]) {
+        memset(slots[i], (unsigned char)(arg->id * STRESS_SLOTS + i), sizes[i]);
+      }
+    }
+  }
+
+  for (int i = 0; i < STRESS_SLOTS; i++) {
+    buddy_free(arg->pool, slots[i]);
+  }
+  return NULL;
+}
+
+/**
+ * Hammer a BUDDY_CONCURRENT pool from several threads and make sure no block
+ * was handed out twice and everything merges back to one block at the end.
+ */
+static void run_concurrent_stress(unsigned int flags, unsigned int release_k) {
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_CONCURRENT | flags, .release_k = release_k };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    args[t] = (struct stress_arg){ .pool = &pool, .seed = (unsigned)rand(), .id = t, .failures = 0 };
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, stress_worker, &args[t]));
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    TEST_ASSERT_EQUAL_INT(0, args[t].failures);
+  }
+
+  TEST_ASSERT_EQUAL_INT(0, pool.busy);
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_concurrent_stress(void) {
+  fprintf(stderr, "-> Testing concurrent pool with %d threads\n", STRESS_THREADS);
+  run_concurrent_stress(0, 0);
+}
+
+void test_concurrent_stress_oob_meta(void) {
+  run_concurrent_stress(BUDDY_OOB_META, 0);
+}
+
+void test_init_opts_rejects_unknown_flags(void) {
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = 0x80000000u };
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, 0, &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+  //The bit tree keeps no per block metadata for the side table to replace
+  opts.flags = BUDDY_BITTREE | BUDDY_OOB_META;
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, 0, &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+}
+
+/**
+ * Small frees land in the thread's magazine and the next malloc of the same
+ * order hands the same block straight back. Flushing returns everything.
+ */
+void test_magazine_reuses_blocks(void) {
+  fprintf(stderr, "-> Testing per thread magazines\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .magazine_depth = 8 };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  void *a = buddy_malloc(&pool, 10);
+  TEST_ASSERT_NOT_NULL(a);
+  buddy_free(&pool, a);
+  //Still cached so it has not been merged back
+  TEST_ASSERT_EQUAL_UINT16(BLOCK_RESERVED, ((struct avail *)a - 1)->tag);
+  TEST_ASSERT_EQUAL_PTR(a, buddy_malloc(&pool, 20));
+
+  //Overflowing the magazine flushes half of it without losing anything
+  void *ptrs[32];
+  for (int i = 0; i < 32; i++) {
+    ptrs[i] = buddy_malloc(&pool, 30);
+    TEST_ASSERT_NOT_NULL(ptrs[i]);
+  }
+  for (int i = 0; i < 32; i++) {
+    buddy_free(&pool, ptrs[i]);
+  }
+  buddy_free(&pool, a);
+
+  //Large orders bypass the magazine
+  void *big = buddy_malloc(&pool, 4000);
+  buddy_free(&pool, big);
+  TEST_ASSERT_EQUAL_UINT16(BLOCK_AVAIL, ((struct avail *)big - 1)->tag);
+
+  buddy_magazine_flush(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+static void *magazine_thread(void *p)
+{
+  struct buddy_pool *pool = p;
+  void *ptrs[16];
+  for (int i = 0; i < 16; i++) {
+    ptrs[i] = buddy_malloc(pool, (size_t)(i * 50) + 1);
+  }
+  for (int i = 0; i < 16; i++) {
+    buddy_free(pool, ptrs[i]);
+  }
+  return NULL;
+}
+
+/**
+ * A thread exiting must hand its magazine back to the pool.
+ */
+void test_magazine_flushed_on_thread_exit(void) {
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_CONCURRENT, .magazine_depth = 16 };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, magazine_thread, &pool));
+  }
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Bulk allocate a batch of same sized blocks, make sure they are all distinct
+ * reserved blocks, then bulk free them and end up with a full pool.
+ */
+void test_malloc_bulk_and_free_bulk(void) {
+  fprintf(stderr, "-> Testing bulk malloc and free\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  size_t user_size = (1 << SMALLEST_K) - sizeof(struct avail);
+  void *ptrs[300];
+  TEST_ASSERT_EQUAL_size_t(300, buddy_malloc_bulk(&pool, user_size, 300, ptrs));
+  check_buddy_pool_mask(&pool);
+
+  for (size_t i = 0; i < 300; i++) {
+    struct avail *header = (struct avail *)ptrs[i] - 1;
+    TEST_ASSERT_EQUAL_UINT16(BLOCK_RESERVED, header->tag);
+    TEST_ASSERT_EQUAL_UINT16(SMALLEST_K, header->kval);
+    memset(ptrs[i], (int)i, user_size);
+  }
+  for (size_t i = 0; i < 300; i++) {
+    TEST_ASSERT_EQUAL_HEX8((unsigned char)i, ((unsigned char *)ptrs[i])[user_size - 1]);
+  }
+
+  //Shuffle so free_bulk has to do the sorting
+  for (size_t i = 299; i > 0; i--) {
+    size_t j = (size_t)rand() % (i + 1);
+    void *tmp = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = tmp;
+  }
+  buddy_free_bulk(&pool, ptrs, 300);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Asking for more blocks than fit returns as many as possible with ENOMEM,
+ * and free_bulk copes with blocks from plain buddy_malloc of mixed sizes.
+ */
+void test_bulk_partial_and_mixed(void) {
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  size_t max_blocks = (UINT64_C(1) << MIN_K) >> SMALLEST_K;
+  void **ptrs = malloc(sizeof(void *) * (max_blocks + 10));
+  TEST_ASSERT_NOT_NULL(ptrs);
+  errno = 0;
+  TEST_ASSERT_EQUAL_size_t(max_blocks, buddy_malloc_bulk(&pool, 1, max_blocks + 10, ptrs));
+  TEST_ASSERT_EQUAL_INT(ENOMEM, errno);
+  check_buddy_pool_empty(&pool);
+  buddy_free_bulk(&pool, ptrs, max_blocks);
+  check_buddy_pool_full(&pool);
+
+  size_t requests[] = { 8, 100, 24, 800, 64, 3000, 40, 200 };
+  for (size_t i = 0; i < 64; i++) {
+    ptrs[i] = buddy_malloc(&pool, requests[i % 8]);
+    TEST_ASSERT_NOT_NULL(ptrs[i]);
+  }
+  ptrs[64] = NULL;
+  buddy_free_bulk(&pool, ptrs, 65);
+  check_buddy_pool_full(&pool);
+
+  free(ptrs);
+  buddy_destroy(&pool);
+}
+
+/**
+ * With out of band metadata a power of two request fits a block of exactly
+ * that size, so the pool holds numbytes / 64 blocks of 64 bytes.
+ */
+void test_oob_meta_exact_fit(void) {
+  fprintf(stderr, "-> Testing out of band block metadata\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_OOB_META };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  TEST_ASSERT_NOT_NULL(pool.meta);
+
+  size_t max_blocks = (UINT64_C(1) << MIN_K) >> SMALLEST_K;
+  unsigned char **ptrs = malloc(sizeof(void *) * max_blocks);
+  TEST_ASSERT_NOT_NULL(ptrs);
+  for (size_t i = 0; i < max_blocks; i++) {
+    ptrs[i] = buddy_malloc(&pool, 64);
+    TEST_ASSERT_NOT_NULL(ptrs[i]);
+    TEST_ASSERT_EQUAL_UINT64(0, ((uintptr_t)ptrs[i] - (uintptr_t)pool.base) % 64);
+    //The whole block belongs to the caller
+    memset(ptrs[i], 0xEE, 64);
+  }
+  TEST_ASSERT_NULL(buddy_malloc(&pool, 1));
+  check_buddy_pool_empty(&pool);
+
+  for (size_t i = 0; i < max_blocks; i += 2) {
+    buddy_free(&pool, ptrs[i]);
+  }
+  for (size_t i = 1; i < max_blocks; i += 2) {
+    TEST_ASSERT_EQUAL_HEX8(0xEE, ptrs[i][0]);
+    buddy_free(&pool, ptrs[i]);
+  }
+  check_buddy_pool_full(&pool);
+
+  //A 2^12 request is a single 2^12 block that can grow in place and shrink
+  unsigned char *page = buddy_malloc(&pool, 4096);
+  memset(page, 0x5A, 4096);
+  TEST_ASSERT_EQUAL_PTR(page, buddy_realloc(&pool, page, 8192));
+  TEST_ASSERT_EQUAL_HEX8(0x5A, page[4095]);
+  TEST_ASSERT_EQUAL_PTR(page, buddy_realloc(&pool, page, 64));
+  TEST_ASSERT_EQUAL_HEX8(0x5A, page[63]);
+  buddy_free(&pool, page);
+
+  TEST_ASSERT_EQUAL_size_t(100, buddy_malloc_bulk(&pool, 128, 100, (void **)ptrs));
+  buddy_free_bulk(&pool, (void **)ptrs, 100);
+  check_buddy_pool_full(&pool);
+
+  free(ptrs);
+  buddy_destroy(&pool);
+}
+
+/**
+ * The bittree backend hands out non overlapping blocks of the right order
+ * and merges everything back, without ever writing into the arena itself.
+ */
+void test_bittree_backend(void) {
+  fprintf(stderr, "-> Testing bittree backend\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_BITTREE };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  TEST_ASSERT_NOT_NULL(pool.bt);
+
+  //Churn without touching any of the memory, no arena page should get faulted in
+  void *ptrs[200];
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 200; i++) {
+      ptrs[i] = buddy_malloc(&pool, (size_t)(rand() % 5000) + 1);
+      TEST_ASSERT_NOT_NULL(ptrs[i]);
+    }
+    for (int i = 0; i < 200; i++) {
+      buddy_free(&pool, ptrs[(i * 7) % 200]);
+    }
+  }
+  size_t pages = pool.numbytes / (size_t)sysconf(_SC_PAGESIZE);
+  unsigned char *resident = malloc(pages);
+  TEST_ASSERT_EQUAL_INT(0, mincore(pool.base, pool.numbytes, resident));
+  for (size_t i = 0; i < pages; i++) {
+    TEST_ASSERT_EQUAL_INT(0, resident[i] & 1);
+  }
+  free(resident);
+  check_buddy_pool_whole(&pool);
+
+  //Exact power of two requests fit, blocks never overlap
+  size_t sizes[] = { 64, 1, 4096, 100, 2048, 64, 70000, 8 };
+  unsigned char *mem[8];
+  for (int i = 0; i < 8; i++) {
+    mem[i] = buddy_malloc(&pool, sizes[i]);
+    TEST_ASSERT_NOT_NULL(mem[i]);
+    memset(mem[i], i + 1, sizes[i]);
+  }
+  for (int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL_HEX8(i + 1, mem[i][sizes[i] - 1]);
+  }
+
+  //Grow in place and shrink work off the split bits too
+  unsigned char *grown = buddy_realloc(&pool, mem[2], 16384);
+  TEST_ASSERT_NOT_NULL(grown);
+  TEST_ASSERT_EQUAL_HEX8(3, grown[4095]);
+  mem[2] = buddy_realloc(&pool, grown, 10);
+  TEST_ASSERT_EQUAL_HEX8(3, mem[2][9]);
+
+  buddy_free_bulk(&pool, (void **)mem, 8);
+  check_buddy_pool_whole(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_concurrent_stress_bittree(void) {
+  run_concurrent_stress(BUDDY_BITTREE, 0);
+}
+
+static int bad_ptr_err;
+static int bad_ptr_count;
+
+static void record_bad_ptr(struct buddy_pool *pool, void *ptr, int err) {
+  (void)pool;
+  (void)ptr;
+  bad_ptr_err = err;
+  bad_ptr_count++;
+}
+
+/**
+ * Free every kind of bad pointer into a checked pool and make sure each one
+ * is reported and leaves the pool intact.
+ */
+static void run_checked_free(unsigned int flags, unsigned int magazine_depth) {
+  struct buddy_pool pool;
+  struct buddy_options opts = {
+    .flags = BUDDY_CHECKED | flags,
+    .magazine_depth = magazine_depth,
+    .on_error = record_bad_ptr,
+  };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  bad_ptr_count = 0;
+
+  char *a = buddy_malloc(&pool, 1000);
+  char *b = buddy_malloc(&pool, 1000);
+  char outside[64];
+
+  buddy_free(&pool, outside);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_RANGE, bad_ptr_err);
+  buddy_free(&pool, (char *)pool.base + pool.numbytes + 64);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_RANGE, bad_ptr_err);
+  buddy_free(&pool, a + 8);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_ALIGN, bad_ptr_err);
+  //Block aligned but inside a, what the header would be is user data
+  bad_ptr_err = 0;
+  buddy_free(&pool, a + 512);
+  TEST_ASSERT_NOT_EQUAL(0, bad_ptr_err);
+  TEST_ASSERT_NULL(buddy_realloc(&pool, a + 8, 10));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  TEST_ASSERT_EQUAL_INT(5, bad_ptr_count);
+
+  //a is free after the first call, and b merges it away after the third
+  buddy_free(&pool, a);
+  buddy_free(&pool, a);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  buddy_free(&pool, b);
+  TEST_ASSERT_EQUAL_INT(6, bad_ptr_count);
+  bad_ptr_err = 0;
+  buddy_free(&pool, b);
+  buddy_free(&pool, a);
+  TEST_ASSERT_NOT_EQUAL(0, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(8, bad_ptr_count);
+
+  //Small blocks that went into a magazine are caught too
+  if (!(flags & BUDDY_BITTREE)) {
+    char *c = buddy_malloc(&pool, 10);
+    buddy_free(&pool, c);
+    buddy_free(&pool, c);
+    TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+    TEST_ASSERT_EQUAL_INT(9, bad_ptr_count);
+    //And come back out as good blocks
+    c = buddy_malloc(&pool, 10);
+    buddy_free(&pool, c);
+    TEST_ASSERT_EQUAL_INT(9, bad_ptr_count);
+  }
+
+  //The same pointer twice in one bulk free is only freed once
+  void *bulk[4];
+  TEST_ASSERT_EQUAL_size_t(3, buddy_malloc_bulk(&pool, 100, 3, bulk));
+  bulk[3] = bulk[1];
+  int before = bad_ptr_count;
+  buddy_free_bulk(&pool, bulk, 4);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(before + 1, bad_ptr_count);
+
+  //A header clobbered by an underrun of the block below it
+  if (!flags) {
+    char *d = buddy_malloc(&pool, 100);
+    ((struct avail *)d - 1)->canary ^= 0x100;
+    buddy_free(&pool, d);
+    TEST_ASSERT_EQUAL_INT(BUDDY_ERR_CANARY, bad_ptr_err);
+    ((struct avail *)d - 1)->canary ^= 0x100;
+    bad_ptr_count = 0;
+    buddy_free(&pool, d);
+    TEST_ASSERT_EQUAL_INT(0, bad_ptr_count);
+  }
+
+  buddy_magazine_flush(&pool);
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_checked_free(void) {
+  fprintf(stderr, "-> Testing checked frees\n");
+  run_checked_free(0, 0);
+  run_checked_free(0, 8);
+  run_checked_free(BUDDY_OOB_META, 8);
+  run_checked_free(BUDDY_BITTREE, 0);
+  run_checked_free(BUDDY_COMPACT, 8);
+}
+
+/**
+ * buddy_stats follows the pool through a split all the way down, a failure
+ * and the merges back up.
+ */
+void test_stats(void) {
+  fprintf(stderr, "-> Testing pool statistics\n");
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(0, st.allocated);
+  TEST_ASSERT_EQUAL_size_t(pool.numbytes, st.free);
+  TEST_ASSERT_EQUAL_size_t(pool.numbytes, st.largest_free);
+  TEST_ASSERT_EQUAL_size_t(1, st.free_blocks[MIN_K]);
+
+  void *a = buddy_malloc(&pool, 1);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(UINT64_C(1) << SMALLEST_K, st.allocated);
+  TEST_ASSERT_EQUAL_size_t(pool.numbytes / 2, st.largest_free);
+  for (size_t k = SMALLEST_K; k < MIN_K; k++) {
+    TEST_ASSERT_EQUAL_size_t(1, st.free_blocks[k]);
+  }
+  TEST_ASSERT_EQUAL_UINT64(1, st.allocs);
+  TEST_ASSERT_EQUAL_UINT64(MIN_K - SMALLEST_K, st.splits);
+  TEST_ASSERT_EQUAL_UINT64((UINT64_C(1) << SMALLEST_K) - 1, st.internal_frag);
+
+  TEST_ASSERT_NULL(buddy_malloc(&pool, pool.numbytes));
+  TEST_ASSERT_NULL(buddy_malloc(&pool, pool.numbytes / 2 + 1));
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_UINT64(2, st.failures);
+
+  buddy_free(&pool, a);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(0, st.allocated);
+  TEST_ASSERT_EQUAL_size_t(pool.numbytes, st.largest_free);
+  TEST_ASSERT_EQUAL_UINT64(MIN_K - SMALLEST_K, st.merges);
+
+  //Bulk and realloc paths keep the same books
+  void *bulk[8];
+  TEST_ASSERT_EQUAL_size_t(8, buddy_malloc_bulk(&pool, 100, 8, bulk));
+  bulk[0] = buddy_realloc(&pool, bulk[0], 30);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(7 * 128 + 64, st.allocated);
+  TEST_ASSERT_EQUAL_UINT64(9, st.allocs);
+  buddy_free_bulk(&pool, bulk, 8);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(0, st.allocated);
+  TEST_ASSERT_EQUAL_UINT64(st.splits, st.merges);
+  buddy_destroy(&pool);
+}
+
+/**
+ * A lazy pool commits nothing but the first header up front and then only
+ * the chunks blocks are handed out from.
+ */
+static void run_lazy_commit(unsigned int flags) {
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  struct buddy_options opts = { .flags = BUDDY_LAZY | flags };
+  size_t chunk = UINT64_C(1) << BUDDY_COMMIT_K;
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << 30, &opts));
+
+  buddy_stats(&pool, &st);
+  size_t first = (flags & BUDDY_BITTREE) ? 0 : chunk;
+  TEST_ASSERT_EQUAL_size_t(first, st.committed);
+
+  //Splitting down writes a header at the start of every upper half, so each
+  //one that starts a chunk of its own gets that chunk committed
+  char *a = buddy_malloc(&pool, 100);
+  memset(a, 1, 100);
+  size_t expect = (flags & BUDDY_BITTREE) ? chunk : chunk * (1 + 30 - BUDDY_COMMIT_K);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(expect, st.committed);
+
+  //The rest of the upper half of the pool is committed when it is handed out
+  size_t big = (UINT64_C(1) << 28) + 1;
+  char *b = buddy_malloc(&pool, big);
+  TEST_ASSERT_TRUE(b >= (char *)pool.base + (UINT64_C(1) << 29));
+  memset(b, 2, big);
+  expect += (UINT64_C(1) << 29) - ((flags & BUDDY_BITTREE) ? 0 : chunk);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(expect, st.committed);
+
+  //Blocks out of chunks that are already committed cost nothing more
+  char *c = buddy_malloc(&pool, 4000);
+  memset(c, 3, 4000);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(expect, st.committed);
+
+  buddy_free(&pool, a);
+  buddy_free(&pool, b);
+  buddy_free(&pool, c);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(0, st.allocated);
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_lazy_commit(void) {
+  fprintf(stderr, "-> Testing lazily committed pools\n");
+  run_lazy_commit(0);
+  run_lazy_commit(BUDDY_OOB_META);
+  run_lazy_commit(BUDDY_BITTREE);
+  run_concurrent_stress(BUDDY_LAZY, 0);
+}
+
+/**
+ * Count the resident pages in [addr, addr + len)
+ */
+static size_t resident_pages(void *addr, size_t len) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  unsigned char *vec = malloc(len / page);
+  TEST_ASSERT_EQUAL_INT(0, mincore(addr, len, vec));
+  size_t n = 0;
+  for (size_t i = 0; i < len / page; i++) {
+    n += vec[i] & 1;
+  }
+  free(vec);
+  return n;
+}
+
+/**
+ * Freeing back up past release_k drops the pages, buddy_trim does the same
+ * for whatever is free on demand.
+ */
+static void run_release(unsigned int flags) {
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  size_t mib = UINT64_C(1) << 20;
+  struct buddy_options opts = { .flags = flags, .release_k = 20 };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << 24, &opts));
+  size_t keep = (flags & BUDDY_BITTREE) ? 0 : 1;
+  //MADV_FREE pages stay resident until the kernel is short of memory
+  bool lazy_free = flags & BUDDY_MADV_FREE;
+
+  char *a = buddy_malloc(&pool, 4 * mib);
+  memset(a, 1, 4 * mib);
+  TEST_ASSERT_TRUE(resident_pages(pool.base, pool.numbytes) >= 4 * mib / (size_t)sysconf(_SC_PAGESIZE));
+  buddy_free(&pool, a);
+  if (!lazy_free) {
+    TEST_ASSERT_EQUAL_size_t(keep, resident_pages(pool.base, pool.numbytes));
+  }
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_UINT64(pool.numbytes - keep * (size_t)sysconf(_SC_PAGESIZE), st.released);
+
+  //Blocks below release_k stay resident until a trim
+  char *b = buddy_malloc(&pool, 100000);
+  memset(b, 2, 100000);
+  char *c = buddy_malloc(&pool, 100000);
+  memset(c, 3, 100000);
+  buddy_free(&pool, b);
+  size_t pages = 100000 / (size_t)sysconf(_SC_PAGESIZE);
+  TEST_ASSERT_TRUE(resident_pages(pool.base, pool.numbytes) > pages);
+  TEST_ASSERT_TRUE(buddy_trim(&pool) > 0);
+  if (!lazy_free) {
+    TEST_ASSERT_TRUE(resident_pages(pool.base, pool.numbytes) <= pages + 30);
+  }
+  TEST_ASSERT_EQUAL_HEX8(3, c[99999]);
+
+  buddy_free(&pool, c);
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_release_to_os(void) {
+  fprintf(stderr, "-> Testing madvise release and trim\n");
+  run_release(0);
+  run_release(BUDDY_BITTREE);
+  run_release(BUDDY_MADV_FREE | BUDDY_OOB_META);
+  run_concurrent_stress(0, 13);
+  run_concurrent_stress(BUDDY_BITTREE, 13);
+
+  struct buddy_pool pool;
+  struct buddy_options opts = { .release_k = SMALLEST_K };
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, 0, &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+}
+
+/**
+ * Huge page pools come back usable whatever the machine supports, with the
+ * flags saying what they really got.
+ */
+void test_huge_pages(void) {
+  fprintf(stderr, "-> Testing huge page backed pools\n");
+  unsigned int variants[] = { BUDDY_HUGE_THP, BUDDY_HUGETLB, BUDDY_HUGETLB | BUDDY_LAZY };
+  for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+    struct buddy_pool pool;
+    struct buddy_options opts = { .flags = variants[v], .release_k = 22 };
+    TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << 26, &opts));
+    TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)pool.base & ((UINT64_C(1) << BUDDY_THP_K) - 1));
+    if (pool.flags & BUDDY_HUGETLB) {
+      TEST_ASSERT_EQUAL_size_t(BUDDY_THP_K, pool.huge_k);
+    } else {
+      TEST_ASSERT_EQUAL_size_t(0, pool.huge_k);
+    }
+
+    char *a = buddy_malloc(&pool, 5 << 20);
+    char *b = buddy_malloc(&pool, 100);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    memset(a, 1, 5 << 20);
+    memset(b, 2, 100);
+    buddy_free(&pool, a);
+    buddy_free(&pool, b);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+  }
+
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_HUGETLB, .huge_k = 4 };
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, 0, &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+}
+
+/**
+ * Aligned allocations of a spread of sizes and alignments, each filled to the
+ * last byte so a block too small for its padding would trip the pool checks.
+ */
+static void run_aligned_alloc(unsigned int flags) {
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  size_t sizes[] = { 1, 40, 100, 4096, 5000 };
+  for (size_t align = 1; align <= 4096; align <<= 1) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      char *p = buddy_aligned_alloc(&pool, align, sizes[i]);
+      TEST_ASSERT_NOT_NULL(p);
+      TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)p % align);
+      memset(p, 0xa5, sizes[i]);
+      buddy_free(&pool, p);
+    }
+  }
+  check_buddy_pool_free(&pool);
+
+  errno = 0;
+  TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, 0, 10));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, 48, 10));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, 64, pool.numbytes + 1));
+  TEST_ASSERT_EQUAL_INT(ENOMEM, errno);
+
+  struct buddy_stats st;
+  char *p = buddy_aligned_alloc(&pool, 64, 40);
+  buddy_stats(&pool, &st);
+  //Cache line alignment is free without headers, header pools pad by 64
+  size_t want = (flags & (BUDDY_OOB_META | BUDDY_BITTREE)) ? 64 : 128;
+  TEST_ASSERT_EQUAL_size_t(want, st.allocated);
+
+  //Growing moves padded memory and keeps the data, shrinking leaves it put
+  char *q = buddy_aligned_alloc(&pool, 4096, 100);
+  TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)q % 4096);
+  memset(q, 7, 100);
+  TEST_ASSERT_EQUAL_PTR(q, buddy_realloc(&pool, q, 50));
+  q = buddy_realloc(&pool, q, 20000);
+  TEST_ASSERT_NOT_NULL(q);
+  for (int i = 0; i < 50; i++) {
+    TEST_ASSERT_EQUAL_INT(7, q[i]);
+  }
+
+  void *ptrs[3] = { p, q, buddy_aligned_alloc(&pool, 256, 300) };
+  buddy_free_bulk(&pool, ptrs, 3);
+  check_buddy_pool_free(&pool);
+
+  if (flags & (BUDDY_OOB_META | BUDDY_BITTREE)) {
+    //No header means no padding, the order alone gives the alignment
+    p = buddy_aligned_alloc(&pool, 4096, 1);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL_size_t(4096, st.allocated);
+    buddy_free(&pool, p);
+    uintptr_t base = (uintptr_t)pool.base;
+    TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, (size_t)(base & -base) * 2, 1));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  } else {
+    //Past the base alignment the block is padded by the whole alignment
+    p = buddy_aligned_alloc(&pool, UINT64_C(1) << (MIN_K - 2), 1);
+    TEST_ASSERT_NOT_NULL(p);
+    TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)p % (UINT64_C(1) << (MIN_K - 2)));
+    buddy_free(&pool, p);
+  }
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_aligned_alloc(void) {
+  fprintf(stderr, "-> Testing aligned allocations\n");
+  run_aligned_alloc(0);
+  run_aligned_alloc(BUDDY_OOB_META);
+  run_aligned_alloc(BUDDY_BITTREE);
+  run_aligned_alloc(BUDDY_COMPACT);
+}
+
+void test_aligned_alloc_checked(void) {
+  fprintf(stderr, "-> Testing checked frees of aligned allocations\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {
+    .flags = BUDDY_CHECKED,
+    .magazine_depth = 8,
+    .on_error = record_bad_ptr,
+  };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  bad_ptr_count = 0;
+
+  char *p = buddy_aligned_alloc(&pool, 256, 100);
+  char *q = buddy_aligned_alloc(&pool, 4096, 100);
+  buddy_free(&pool, p);
+  buddy_free(&pool, q);
+  TEST_ASSERT_EQUAL_INT(0, bad_ptr_count);
+
+  //The shims outlive the blocks, so the second free finds a free block
+  buddy_free(&pool, p);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  buddy_free(&pool, q);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(2, bad_ptr_count);
+
+  //A clobbered shim is not followed
+  q = buddy_aligned_alloc(&pool, 4096, 100);
+  ((struct avail *)q - 1)->canary ^= 0x100;
+  buddy_free(&pool, q);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_CANARY, bad_ptr_err);
+  ((struct avail *)q - 1)->canary ^= 0x100;
+  buddy_free(&pool, q);
+  TEST_ASSERT_EQUAL_INT(3, bad_ptr_count);
+
+  buddy_magazine_flush(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  //Alignments below two headers still keep the shim clear of the block's
+  //header, which a free to the lists overwrites with links
+  opts.magazine_depth = 0;
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  bad_ptr_count = 0;
+  size_t small[] = { 16, 32 };
+  for (int i = 0; i < 2; i++) {
+    p = buddy_aligned_alloc(&pool, small[i], 100);
+    TEST_ASSERT_NOT_NULL(p);
+    TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)p % small[i]);
+    memset(p, 0xab, 100);
+    buddy_free(&pool, p);
+    TEST_ASSERT_EQUAL_INT(i, bad_ptr_count);
+    buddy_free(&pool, p);
+    TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+    TEST_ASSERT_EQUAL_INT(i + 1, bad_ptr_count);
+  }
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+static bool all_zero(const char *p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Zeroed memory from a pool, checking that memory known to be zero already is
+ * not written again by looking at how much of it becomes resident.
+ */
+static void run_calloc(unsigned int flags) {
+  struct buddy_pool pool;
+  size_t mib = UINT64_C(1) << 20;
+  struct buddy_options opts = { .flags = flags, .release_k = 20 };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << 24, &opts));
+  bool tracked = !(flags & BUDDY_BITTREE);
+
+  //Fresh from mmap, only the pages holding the split headers get touched
+  char *a = buddy_calloc(&pool, 1000, 4000);
+  TEST_ASSERT_NOT_NULL(a);
+  if (tracked) {
+    TEST_ASSERT_EQUAL_size_t(3, resident_pages(pool.base, pool.numbytes));
+  }
+  TEST_ASSERT_TRUE(all_zero(a, 4000000));
+
+  //Dirty memory below release_k has to be cleared
+  char *b = buddy_malloc(&pool, 100000);
+  memset(b, 0xff, 100000);
+  buddy_free(&pool, b);
+  b = buddy_calloc(&pool, 100000, 1);
+  TEST_ASSERT_TRUE(all_zero(b, 100000));
+
+  //Freeing a purges it, so it comes back zero without another pass
+  memset(a, 0xff, 4000000);
+  buddy_free(&pool, a);
+  size_t before = resident_pages(pool.base, pool.numbytes);
+  a = buddy_calloc(&pool, 4, mib);
+  if (tracked) {
+    TEST_ASSERT_TRUE(resident_pages(pool.base, pool.numbytes) <= before + 1);
+  }
+  TEST_ASSERT_TRUE(all_zero(a, 4 * mib));
+
+  //Small blocks and the upper halves of split blocks stay clean
+  char *small[16];
+  for (int i = 0; i < 16; i++) {
+    small[i] = buddy_calloc(&pool, 10, 10 + i * 50);
+    TEST_ASSERT_TRUE(all_zero(small[i], 10 * (10 + i * 50)));
+    memset(small[i], 0xff, 10 * (10 + i * 50));
+  }
+  for (int i = 0; i < 16; i++) {
+    buddy_free(&pool, small[i]);
+  }
+
+  errno = 0;
+  TEST_ASSERT_NULL(buddy_calloc(&pool, SIZE_MAX / 2, 4));
+  TEST_ASSERT_EQUAL_INT(ENOMEM, errno);
+  TEST_ASSERT_NULL(buddy_calloc(&pool, 0, 4));
+
+  buddy_free(&pool, a);
+  buddy_free(&pool, b);
+  check_buddy_pool_free(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_calloc(void) {
+  fprintf(stderr, "-> Testing zeroed allocations\n");
+  run_calloc(0);
+  run_calloc(BUDDY_OOB_META);
+  run_calloc(BUDDY_BITTREE);
+}
+
+void test_usable_size(void) {
+  fprintf(stderr, "-> Testing usable sizes\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  size_t hdr = sizeof(struct avail);
+
+  char *a = buddy_malloc(&pool, 1);
+  TEST_ASSERT_EQUAL_size_t((UINT64_C(1) << SMALLEST_K) - hdr, buddy_usable_size(&pool, a));
+  char *b = buddy_malloc(&pool, 1000);
+  size_t usable = buddy_usable_size(&pool, b);
+  TEST_ASSERT_EQUAL_size_t(1024 - hdr, usable);
+  //The slack is the caller's, growing into it does not move anything
+  memset(b, 1, usable);
+  TEST_ASSERT_EQUAL_PTR(b, buddy_realloc(&pool, b, usable));
+  TEST_ASSERT_EQUAL_size_t(usable, buddy_usable_size(&pool, b));
+
+  char *c = buddy_aligned_alloc(&pool, 4096, 100);
+  TEST_ASSERT_EQUAL_size_t(8192 - 4096, buddy_usable_size(&pool, c));
+  TEST_ASSERT_EQUAL_size_t(0, buddy_usable_size(&pool, NULL));
+
+  buddy_free(&pool, a);
+  buddy_free(&pool, b);
+  buddy_free(&pool, c);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  //Without headers the whole block is usable
+  struct buddy_options opts = { .flags = BUDDY_OOB_META };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  a = buddy_malloc(&pool, 1000);
+  TEST_ASSERT_EQUAL_size_t(1024, buddy_usable_size(&pool, a));
+  buddy_free(&pool, a);
+  buddy_destroy(&pool);
+}
+
+void test_grow_arenas(void) {
+  fprintf(stderr, "-> Testing pools that grow extra arenas\n");
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  size_t kib = 1024;
+  struct buddy_options opts = { .flags = BUDDY_GROW | BUDDY_CHECKED, .on_error = record_bad_ptr };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  bad_ptr_count = 0;
+
+  //Each of these takes a whole arena the size of the pool
+  char *a = buddy_malloc(&pool, 600 * kib);
+  char *b = buddy_malloc(&pool, 600 * kib);
+  char *c = buddy_calloc(&pool, 600, kib);
+  TEST_ASSERT_NOT_NULL(b);
+  TEST_ASSERT_NOT_NULL(c);
+  TEST_ASSERT_EQUAL_PTR((char *)pool.base + sizeof(struct avail), a);
+  memset(b, 1, 600 * kib);
+  memset(c, 2, 600 * kib);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(2, st.arenas);
+  TEST_ASSERT_EQUAL_size_t(3 << MIN_K, st.allocated);
+
+  //Too large for the pool at all gets an arena of its own size
+  char *d = buddy_aligned_alloc(&pool, 4096, 3000 * kib);
+  TEST_ASSERT_NOT_NULL(d);
+  TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)d % 4096);
+  TEST_ASSERT_TRUE(buddy_usable_size(&pool, d) >= 3000 * kib);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(3, st.arenas);
+
+  //Growing out of a full arena moves to another one with the data
+  b = buddy_realloc(&pool, b, 900 * kib);
+  TEST_ASSERT_NOT_NULL(b);
+  TEST_ASSERT_EQUAL_INT8(1, b[600 * kib - 1]);
+  TEST_ASSERT_EQUAL_size_t(1 << MIN_K, buddy_usable_size(&pool, b) + sizeof(struct avail));
+
+  //Pointers in no arena are still caught
+  char outside[64];
+  buddy_free(&pool, outside);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_RANGE, bad_ptr_err);
+  buddy_free(&pool, c);
+  buddy_free(&pool, c);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(2, bad_ptr_count);
+
+  //Bulk calls spill over too, into the arena c left as a spare
+  void *small[4];
+  TEST_ASSERT_EQUAL_size_t(4, buddy_malloc_bulk(&pool, 200 * kib, 4, small));
+  buddy_free_bulk(&pool, small, 4);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(3, st.arenas);
+
+  //Emptied arenas are unmapped, except for one spare
+  buddy_free(&pool, b);
+  buddy_free(&pool, d);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(1, st.arenas);
+  TEST_ASSERT_EQUAL_size_t(1 << MIN_K, st.allocated);
+  TEST_ASSERT_TRUE(buddy_trim(&pool) >= (size_t)1 << MIN_K);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(0, st.arenas);
+
+  buddy_free(&pool, a);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_concurrent_stress_grow(void) {
+  fprintf(stderr, "-> Testing concurrent pools growing arenas\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_CONCURRENT | BUDDY_GROW };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  //Fill the pool's own arena so every thread works in grown ones
+  void *hog = buddy_malloc(&pool, pool.numbytes - sizeof(struct avail));
+  TEST_ASSERT_NOT_NULL(hog);
+
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    args[t] = (struct stress_arg){ .pool = &pool, .seed = (unsigned)rand(), .id = t, .failures = 0 };
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, stress_worker, &args[t]));
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    TEST_ASSERT_EQUAL_INT(0, args[t].failures);
+  }
+
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(1, st.arenas);
+  TEST_ASSERT_EQUAL_size_t(pool.numbytes, st.allocated);
+  buddy_free(&pool, hog);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_slab(void) {
+  fprintf(stderr, "-> Testing slabs for tiny objects\n");
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  struct buddy_options opts = { .flags = BUDDY_SLAB | BUDDY_CHECKED, .on_error = record_bad_ptr };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  bad_ptr_count = 0;
+
+  //A thousand 8 byte objects fit in a few slabs instead of 64 bytes each
+  size_t slab = UINT64_C(1) << BUDDY_SLAB_K;
+  char *objs[1000];
+  for (int i = 0; i < 1000; i++) {
+    objs[i] = buddy_malloc(&pool, 8);
+    TEST_ASSERT_NOT_NULL(objs[i]);
+    TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)objs[i] % 8);
+    memset(objs[i], i & 0xff, 8);
+  }
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(3 * slab, st.allocated);
+  for (int i = 0; i < 1000; i++) {
+    TEST_ASSERT_EQUAL_INT8((char)(i & 0xff), objs[i][7]);
+  }
+  TEST_ASSERT_EQUAL_size_t(8, buddy_usable_size(&pool, objs[0]));
+
+  //Each class has slabs of its own
+  char *mid = buddy_calloc(&pool, 3, 10);
+  TEST_ASSERT_EQUAL_size_t(32, buddy_usable_size(&pool, mid));
+  TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)mid % 16);
+  for (int i = 0; i < 30; i++) {
+    TEST_ASSERT_EQUAL_INT8(0, mid[i]);
+  }
+  char *big = buddy_malloc(&pool, BUDDY_SLAB_MAX + 1);
+  TEST_ASSERT_EQUAL_size_t(128 - sizeof(struct avail), buddy_usable_size(&pool, big));
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(4 * slab + 128, st.allocated);
+
+  //Growing a slot past its class moves it to a real block
+  memcpy(mid, "slab", 5);
+  TEST_ASSERT_EQUAL_PTR(mid, buddy_realloc(&pool, mid, 32));
+  mid = buddy_realloc(&pool, mid, 100);
+  TEST_ASSERT_EQUAL_STRING("slab", mid);
+  TEST_ASSERT_EQUAL_size_t(128 - sizeof(struct avail), buddy_usable_size(&pool, mid));
+
+  //Bad slots are caught like bad blocks
+  buddy_free(&pool, objs[5] + 1);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_ALIGN, bad_ptr_err);
+  buddy_free(&pool, objs[5]);
+  buddy_free(&pool, objs[5]);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(2, bad_ptr_count);
+
+  //Emptied slabs go back, except for one kept per class until a trim
+  buddy_free_bulk(&pool, (void **)objs, 5);
+  buddy_free_bulk(&pool, (void **)objs + 6, 994);
+  buddy_free(&pool, mid);
+  buddy_free(&pool, big);
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(2 * slab, st.allocated);
+  buddy_trim(&pool);
+  TEST_ASSERT_EQUAL_INT(2, bad_ptr_count);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * A slab pool with no block of 2^BUDDY_SLAB_K left still serves tiny
+ * requests from the smaller free blocks, like a pool without slabs does.
+ */
+void test_slab_fragmented(void) {
+  fprintf(stderr, "-> Testing slab pools with no slab sized block free\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_SLAB };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  //Fill the pool with 2KiB blocks and free one of them again
+  size_t n = (UINT64_C(1) << MIN_K) >> 11;
+  char **blocks = malloc(n * sizeof(char *));
+  TEST_ASSERT_NOT_NULL(blocks);
+  for (size_t i = 0; i < n; i++) {
+    blocks[i] = buddy_malloc(&pool, 1500);
+    TEST_ASSERT_NOT_NULL(blocks[i]);
+  }
+  TEST_ASSERT_NULL(buddy_malloc(&pool, 1500));
+  buddy_free(&pool, blocks[n / 2]);
+
+  char *tiny = buddy_malloc(&pool, 8);
+  TEST_ASSERT_NOT_NULL(tiny);
+  memset(tiny, 1, 8);
+  char *zeroed = buddy_calloc(&pool, 2, 4);
+  TEST_ASSERT_NOT_NULL(zeroed);
+  for (int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL_INT8(0, zeroed[i]);
+  }
+  TEST_ASSERT_TRUE(buddy_usable_size(&pool, tiny) >= 8);
+
+  buddy_free(&pool, tiny);
+  buddy_free(&pool, zeroed);
+  blocks[n / 2] = NULL;
+  for (size_t i = 0; i < n; i++) {
+    buddy_free(&pool, blocks[i]);
+  }
+  free(blocks);
+  buddy_trim(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Grown arenas that only served slabs are reaped like any other once their
+ * objects are gone, the empty slab cached per class does not pin them.
+ */
+void test_grow_slab_reap(void) {
+  fprintf(stderr, "-> Testing reaping grown arenas of slabs\n");
+  unsigned int variants[] = { BUDDY_GROW, BUDDY_GROW | BUDDY_SLAB,
+                              BUDDY_GROW | BUDDY_SLAB | BUDDY_CONCURRENT };
+  for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    struct buddy_options opts = { .flags = variants[v] };
+    TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+    size_t n = 300000;
+    void **objs = malloc(n * sizeof(void *));
+    TEST_ASSERT_NOT_NULL(objs);
+    for (size_t i = 0; i < n; i++) {
+      objs[i] = buddy_malloc(&pool, 8);
+      TEST_ASSERT_NOT_NULL(objs[i]);
+    }
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_TRUE(st.arenas >= 1);
+
+    //Only the spare arena is left, and a trim takes that too
+    for (size_t i = 0; i < n; i++) {
+      buddy_free(&pool, objs[i]);
+    }
+    free(objs);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_TRUE(st.arenas <= 1);
+    buddy_trim(&pool);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL_size_t(0, st.arenas);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+  }
+}
+
+void test_concurrent_stress_slab(void) {
+  fprintf(stderr, "-> Testing concurrent pools with slabs\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_CONCURRENT | BUDDY_SLAB };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    args[t] = (struct stress_arg){ .pool = &pool, .seed = (unsigned)rand(), .id = t, .max_size = 80 };
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, stress_worker, &args[t]));
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    TEST_ASSERT_EQUAL_INT(0, args[t].failures);
+  }
+
+  buddy_trim(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Wait for a forked child and return its exit status, -1 if it did not exit.
+ */
+static int child_status(pid_t pid) {
+  int status = 0;
+  TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_shared_pool(void) {
+  fprintf(stderr, "-> Testing pools shared with child processes\n");
+  struct buddy_options opts = { .flags = BUDDY_CHECKED };
+  struct buddy_pool *pool = buddy_init_shared(NULL, UINT64_C(1) << MIN_K, &opts);
+  TEST_ASSERT_NOT_NULL(pool);
+  TEST_ASSERT_EQUAL_UINT(BUDDY_SHARED | BUDDY_CONCURRENT | BUDDY_CHECKED, pool->flags);
+  check_buddy_pool_full(pool);
+
+  //A buffer the child allocates is read and freed by the parent
+  char **slot = buddy_malloc(pool, sizeof(char *));
+  *slot = NULL;
+  pid_t pid = fork();
+  TEST_ASSERT_NOT_EQUAL(-1, pid);
+  if (pid == 0) {
+    char *msg = buddy_malloc(pool, 100);
+    if (!msg) {
+      _exit(1);
+    }
+    strcpy(msg, "from the child");
+    *slot = msg;
+    _exit(0);
+  }
+  TEST_ASSERT_EQUAL_INT(0, child_status(pid));
+  TEST_ASSERT_NOT_NULL(*slot);
+  TEST_ASSERT_EQUAL_STRING("from the child", *slot);
+  buddy_free(pool, *slot);
+  buddy_free(pool, slot);
+  check_buddy_pool_full(pool);
+
+  //Processes allocating at the same time never get the same block
+  pid_t kids[2];
+  for (int c = 0; c < 2; c++) {
+    kids[c] = fork();
+    TEST_ASSERT_NOT_EQUAL(-1, kids[c]);
+    if (kids[c] == 0) {
+      struct stress_arg arg = { .pool = pool, .seed = (unsigned)rand() + c, .id = c };
+      stress_worker(&arg);
+      _exit(arg.failures ? 1 : 0);
+    }
+  }
+  struct stress_arg arg = { .pool = pool, .seed = (unsigned)rand(), .id = 2 };
+  stress_worker(&arg);
+  TEST_ASSERT_EQUAL_INT(0, arg.failures);
+  for (int c = 0; c < 2; c++) {
+    TEST_ASSERT_EQUAL_INT(0, child_status(kids[c]));
+  }
+  TEST_ASSERT_EQUAL_INT(0, pool->busy);
+  check_buddy_pool_full(pool);
+
+  //Trimming removes the pages from the shared memory, so they read back as zero
+  size_t half = pool->numbytes / 2;
+  char *big = buddy_malloc(pool, half);
+  memset(big, 0xff, half - sizeof(struct avail));
+  buddy_free(pool, big);
+  TEST_ASSERT_TRUE(buddy_trim(pool) >= half - 4096);
+  big = buddy_calloc(pool, 1, half - sizeof(struct avail));
+  TEST_ASSERT_TRUE(all_zero(big, half - sizeof(struct avail)));
+  buddy_free(pool, big);
+  check_buddy_pool_full(pool);
+  buddy_destroy(pool);
+}
+
+void test_shared_pool_named(void) {
+  struct buddy_pool plain;
+  struct buddy_options bad = { .flags = BUDDY_SLAB };
+  TEST_ASSERT_NULL(buddy_init_shared(NULL, 0, &bad));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  bad = (struct buddy_options){ .magazine_depth = 8 };
+  TEST_ASSERT_NULL(buddy_init_shared(NULL, 0, &bad));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  bad = (struct buddy_options){ .flags = BUDDY_SHARED };
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&plain, 0, &bad));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+  char name[64];
+  snprintf(name, sizeof(name), "/buddy-test-%d", (int)getpid());
+  struct buddy_pool *pool = buddy_init_shared(name, UINT64_C(1) << MIN_K, NULL);
+  TEST_ASSERT_NOT_NULL(pool);
+  TEST_ASSERT_NULL(buddy_init_shared(name, UINT64_C(1) << MIN_K, NULL));
+  TEST_ASSERT_EQUAL_INT(EEXIST, errno);
+
+  //This process already has the region where it has to go
+  TEST_ASSERT_NULL(buddy_open_shared(name));
+  TEST_ASSERT_EQUAL_INT(EEXIST, errno);
+
+  //A child that drops its inherited mapping can open the pool by name
+  int **slot = buddy_malloc(pool, sizeof(int *));
+  pid_t pid = fork();
+  TEST_ASSERT_NOT_EQUAL(-1, pid);
+  if (pid == 0) {
+    buddy_close_shared(pool);
+    struct buddy_pool *again = buddy_open_shared(name);
+    if (again != pool) {
+      _exit(1);
+    }
+    *slot = buddy_malloc(again, sizeof(int));
+    **slot = 42;
+    buddy_close_shared(again);
+    _exit(0);
+  }
+  TEST_ASSERT_EQUAL_INT(0, child_status(pid));
+  TEST_ASSERT_EQUAL_INT(42, **slot);
+  buddy_free(pool, *slot);
+  buddy_free(pool, slot);
+  check_buddy_pool_full(pool);
+
+  buddy_destroy(pool);
+  TEST_ASSERT_NULL(buddy_open_shared(name));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+}
+
+void test_compact_headers(void) {
+  fprintf(stderr, "-> Testing compact block headers\n");
+  struct buddy_pool pool;
+  struct buddy_stats st;
+  struct buddy_options opts = { .flags = BUDDY_COMPACT | BUDDY_BITTREE };
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, 0, &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  opts = (struct buddy_options){ .flags = BUDDY_COMPACT };
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_opts(&pool, UINT64_C(1) << (BUDDY_COMPACT_MAX_K + 1), &opts));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+  opts = (struct buddy_options){ .flags = BUDDY_COMPACT | BUDDY_CHECKED, .on_error = record_bad_ptr };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  check_buddy_pool_full(&pool);
+  bad_ptr_count = 0;
+
+  //48 bytes and the 16 byte header fit the smallest block
+  char *small = buddy_malloc(&pool, 48);
+  TEST_ASSERT_EQUAL_PTR((char *)pool.base + sizeof(struct avail_compact), small);
+  TEST_ASSERT_EQUAL_size_t(48, buddy_usable_size(&pool, small));
+  buddy_stats(&pool, &st);
+  TEST_ASSERT_EQUAL_size_t(64, st.allocated);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+
+  //Leave free blocks on several lists, and padded aligned memory in use
+  size_t sizes[] = { 100, 1000, 3000, 48, 20000, 7, 500, 9000 };
+  char *blocks[8];
+  for (int i = 0; i < 8; i++) {
+    blocks[i] = buddy_malloc(&pool, sizes[i]);
+    TEST_ASSERT_NOT_NULL(blocks[i]);
+    memset(blocks[i], i + 1, sizes[i]);
+  }
+  char *aligned = buddy_aligned_alloc(&pool, 256, 100);
+  TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)aligned % 256);
+  for (int i = 1; i < 8; i += 2) {
+    buddy_free(&pool, blocks[i]);
+  }
+
+  //A copy of the arena somewhere else works once base follows it
+  char *copy = mmap(NULL, pool.numbytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  TEST_ASSERT_NOT_EQUAL(MAP_FAILED, copy);
+  memcpy(copy, pool.base, pool.numbytes);
+  struct buddy_pool moved = pool;
+  moved.base = copy;
+  ptrdiff_t delta = copy - (char *)pool.base;
+  buddy_free(&pool, aligned);
+  for (int i = 0; i < 8; i += 2) {
+    TEST_ASSERT_EQUAL_INT8(i + 1, blocks[i][sizes[i] - 1]);
+    buddy_free(&pool, blocks[i]);
+  }
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  for (int i = 0; i < 8; i += 2) {
+    char *b = blocks[i] + delta;
+    TEST_ASSERT_TRUE(buddy_usable_size(&moved, b) >= sizes[i]);
+    TEST_ASSERT_EQUAL_INT8(i + 1, b[sizes[i] - 1]);
+    buddy_free(&moved, b);
+  }
+  buddy_free(&moved, aligned + delta);
+  buddy_free(&moved, blocks[1] + delta);
+  TEST_ASSERT_EQUAL_INT(BUDDY_ERR_FREED, bad_ptr_err);
+  TEST_ASSERT_EQUAL_INT(1, bad_ptr_count);
+  check_buddy_pool_full(&moved);
+  buddy_destroy(&moved);
+}
+
+void test_concurrent_stress_compact(void) {
+  run_concurrent_stress(BUDDY_COMPACT, 0);
+}
+
+/**
+ * What a pool held when it was written, for checking the restored copies.
+ */
+struct snap_contents
+{
+  char *base;
+  char *blocks[8];
+  size_t sizes[8];
+  char *aligned;
+  char *big;
+  size_t allocated;
+};
+
+/**
+ * Check that a restored pool holds what was written, at the same offsets,
+ * and that all of it can be freed again.
+ */
+static void check_restored(struct buddy_pool *pool, struct snap_contents *c) {
+  struct buddy_stats st;
+  buddy_stats(pool, &st);
+  TEST_ASSERT_EQUAL_size_t(c->allocated, st.allocated);
+  TEST_ASSERT_TRUE(pool->flags & BUDDY_RESTORED);
+
+  ptrdiff_t delta = (char *)pool->base - c->base;
+  for (int i = 0; i < 8; i += 2) {
+    char *b = c->blocks[i] + delta;
+    TEST_ASSERT_EQUAL_INT8(i + 1, b[0]);
+    TEST_ASSERT_EQUAL_INT8(i + 1, b[c->sizes[i] - 1]);
+    buddy_free(pool, b);
+  }
+  TEST_ASSERT_EQUAL_STRING("aligned", c->aligned + delta);
+  buddy_free(pool, c->aligned + delta);
+
+  //Released pages come back from the file, not zero, so calloc clears them
+  size_t len = pool->numbytes / 4 - 64;
+  TEST_ASSERT_EQUAL_INT8((char)0xff, c->big[len - 1 + delta]);
+  buddy_free(pool, c->big + delta);
+  TEST_ASSERT_TRUE(buddy_trim(pool) > 0);
+  char *z = buddy_calloc(pool, 1, len);
+  TEST_ASSERT_TRUE(all_zero(z, len));
+  buddy_free(pool, z);
+
+  check_buddy_pool_free(pool);
+}
+
+static void run_snapshot(unsigned int flags) {
+  struct buddy_pool pool;
+  struct buddy_pool restored;
+  struct buddy_options opts = { .flags = flags };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << (MIN_K + 2), &opts));
+
+  //Reserved blocks of many sizes with free ones between them
+  struct snap_contents c = { .base = pool.base, .sizes = { 100, 1000, 3000, 48, 20000, 7, 500, 9000 } };
+  for (int i = 0; i < 8; i++) {
+    c.blocks[i] = buddy_malloc(&pool, c.sizes[i]);
+    TEST_ASSERT_NOT_NULL(c.blocks[i]);
+    memset(c.blocks[i], i + 1, c.sizes[i]);
+  }
+  c.aligned = buddy_aligned_alloc(&pool, 4096, 100);
+  strcpy(c.aligned, "aligned");
+  c.big = buddy_malloc(&pool, pool.numbytes / 4 - 64);
+  memset(c.big, 0xff, pool.numbytes / 4 - 64);
+  for (int i = 1; i < 8; i += 2) {
+    buddy_free(&pool, c.blocks[i]);
+  }
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  c.allocated = st.allocated;
+
+  char path[] = "/tmp/buddy-snap-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_NOT_EQUAL(-1, fd);
+  close(fd);
+  TEST_ASSERT_EQUAL_INT(0, buddy_snapshot(&pool, path));
+
+  //Free memory is left out of the file
+  struct stat sb;
+  TEST_ASSERT_EQUAL_INT(0, stat(path, &sb));
+  TEST_ASSERT_TRUE((size_t)sb.st_blocks * 512 < pool.numbytes / 2);
+
+  //The old arena is still there, so the new one goes somewhere else
+  TEST_ASSERT_EQUAL_INT(0, buddy_restore(&restored, path));
+  TEST_ASSERT_NOT_EQUAL(pool.base, restored.base);
+  check_restored(&restored, &c);
+  buddy_destroy(&restored);
+
+  //With the old pool gone pointer linked pools land where they were
+  buddy_destroy(&pool);
+  TEST_ASSERT_EQUAL_INT(0, buddy_restore(&restored, path));
+  if (!(flags & (BUDDY_COMPACT | BUDDY_BITTREE))) {
+    TEST_ASSERT_EQUAL_PTR(c.base, restored.base);
+  }
+  check_restored(&restored, &c);
+  buddy_destroy(&restored);
+
+  //The file is left alone by the pools restored from it
+  TEST_ASSERT_EQUAL_INT(0, buddy_restore(&restored, path));
+  check_restored(&restored, &c);
+  buddy_destroy(&restored);
+  unlink(path);
+}
+
+void test_snapshot_restore(void) {
+  fprintf(stderr, "-> Testing pool snapshots\n");
+  run_snapshot(0);
+  run_snapshot(BUDDY_COMPACT | BUDDY_CHECKED);
+  run_snapshot(BUDDY_OOB_META | BUDDY_CONCURRENT);
+  run_snapshot(BUDDY_BITTREE);
+  run_snapshot(BUDDY_LAZY);
+
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_GROW };
+  TEST_ASSERT_EQUAL_INT(0, buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts));
+  TEST_ASSERT_EQUAL_INT(-1, buddy_snapshot(&pool, "/tmp/buddy-snap-grow"));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  buddy_destroy(&pool);
+
+  //Anything that is not a snapshot is turned away
+  char path[] = "/tmp/buddy-snap-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_EQUAL_INT(5, write(fd, "hello", 5));
+  close(fd);
+  TEST_ASSERT_EQUAL_INT(-1, buddy_restore(&pool, path));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  unlink(path);
+  TEST_ASSERT_EQUAL_INT(-1, buddy_restore(&pool, path));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+}
+
+/**
+ * Disk space of a file in bytes, going by the blocks it has allocated.
+ */
+static uint64_t file_disk_bytes(const char *path) {
+  struct stat st;
+  TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+  return (uint64_t)st.st_blocks * 512;
+}
+
+void test_file_backed_pool(void) {
+  fprintf(stderr, "-> Testing file backed pools\n");
+  unsigned int variants[] = { 0, BUDDY_CONCURRENT | BUDDY_CHECKED, BUDDY_OOB_META, BUDDY_BITTREE,
+                              BUDDY_COMPACT, BUDDY_LAZY };
+  for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+    char path[] = "/tmp/buddy-file-XXXXXX";
+    close(mkstemp(path));
+    struct buddy_pool pool;
+    struct buddy_options opts = { .flags = variants[v] };
+    //Far more than gets written, the file stays sparse
+    TEST_ASSERT_EQUAL_INT(0, buddy_init_file(&pool, path, UINT64_C(1) << 32, &opts));
+    TEST_ASSERT_TRUE(pool.flags & BUDDY_FILE);
+    TEST_ASSERT_EQUAL_size_t(BUDDY_FILE_RELEASE_K, pool.release_k);
+    struct stat st;
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+    TEST_ASSERT_EQUAL_UINT64(UINT64_C(1) << 32, (uint64_t)st.st_size);
+    TEST_ASSERT_TRUE(file_disk_bytes(path) < (UINT64_C(1) << 22));
+
+    char *a = buddy_malloc(&pool, 16 << 20);
+    char *b = buddy_malloc(&pool, 100);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    memset(a, 0x5a, 16 << 20);
+    memset(b, 0x6b, 100);
+    TEST_ASSERT_EQUAL_INT(0, msync(pool.base, pool.numbytes, MS_SYNC));
+    uint64_t used = file_disk_bytes(path);
+    TEST_ASSERT_TRUE(used >= (UINT64_C(16) << 20));
+
+    //The freed block is punched out of the file and reads back as zero
+    buddy_free(&pool, a);
+    TEST_ASSERT_TRUE(file_disk_bytes(path) < used - (UINT64_C(8) << 20));
+    char *c = buddy_calloc(&pool, 1, 16 << 20);
+    TEST_ASSERT_NOT_NULL(c);
+    for (size_t i = 0; i < (16 << 20); i += 4096)
+      TEST_ASSERT_EQUAL_CHAR(0, c[i]);
+    buddy_free(&pool, c);
+    TEST_ASSERT_EQUAL_CHAR(0x6b, b[99]);
+    buddy_free(&pool, b);
+    check_buddy_pool_free(&pool);
+
+    //Unlinking does not get in the way of a live pool
+    unlink(path);
+    char *d = buddy_malloc(&pool, 1 << 20);
+    TEST_ASSERT_NOT_NULL(d);
+    memset(d, 1, 1 << 20);
+    buddy_free(&pool, d);
+    check_buddy_pool_free(&pool);
+    buddy_destroy(&pool);
+  }
+
+  struct buddy_pool pool;
+  unsigned int bad[] = { BUDDY_MADV_FREE, BUDDY_HUGE_THP, BUDDY_HUGETLB, BUDDY_GROW };
+  for (size_t v = 0; v < sizeof(bad) / sizeof(bad[0]); v++) {
+    struct buddy_options opts = { .flags = bad[v] };
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, buddy_init_file(&pool, "/tmp/buddy-file-bad", 0, &opts));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  }
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(-1, buddy_init_file(&pool, "/nonexistent/buddy-file", 0, NULL));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+}
+
 int main(void) {
   time_t t;
   unsigned seed = (unsigned)time(&t);
@@ -323,9 +2141,45 @@ int main(void) {
   RUN_TEST(test_buddy_malloc_one_byte);
   RUN_TEST(test_buddy_malloc_one_large);
   RUN_TEST(test_btok_boundaries);
+  RUN_TEST(test_btok_every_order);
   RUN_TEST(test_buddy_calc);
   RUN_TEST(test_malloc_minimum_block);
   RUN_TEST(test_malloc_multiple_small_blocks);
   RUN_TEST(test_malloc_mixed_sizes);
+  RUN_TEST(test_avail_mask_tracks_lists);
+  RUN_TEST(test_trace_ring);
+  RUN_TEST(test_realloc_in_place);
+  RUN_TEST(test_realloc_moves_when_buddy_busy);
+  RUN_TEST(test_concurrent_stress);
+  RUN_TEST(test_init_opts_rejects_unknown_flags);
+  RUN_TEST(test_magazine_reuses_blocks);
+  RUN_TEST(test_magazine_flushed_on_thread_exit);
+  RUN_TEST(test_malloc_bulk_and_free_bulk);
+  RUN_TEST(test_bulk_partial_and_mixed);
+  RUN_TEST(test_oob_meta_exact_fit);
+  RUN_TEST(test_concurrent_stress_oob_meta);
+  RUN_TEST(test_bittree_backend);
+  RUN_TEST(test_concurrent_stress_bittree);
+  RUN_TEST(test_checked_free);
+  RUN_TEST(test_stats);
+  RUN_TEST(test_lazy_commit);
+  RUN_TEST(test_release_to_os);
+  RUN_TEST(test_huge_pages);
+  RUN_TEST(test_aligned_alloc);
+  RUN_TEST(test_aligned_alloc_checked);
+  RUN_TEST(test_calloc);
+  RUN_TEST(test_usable_size);
+  RUN_TEST(test_grow_arenas);
+  RUN_TEST(test_concurrent_stress_grow);
+  RUN_TEST(test_slab);
+  RUN_TEST(test_slab_fragmented);
+  RUN_TEST(test_grow_slab_reap);
+  RUN_TEST(test_concurrent_stress_slab);
+  RUN_TEST(test_shared_pool);
+  RUN_TEST(test_shared_pool_named);
+  RUN_TEST(test_compact_headers);
+  RUN_TEST(test_concurrent_stress_compact);
+  RUN_TEST(test_snapshot_restore);
+  RUN_TEST(test_file_backed_pool);
 return UNITY_END();
 }